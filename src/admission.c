@@ -0,0 +1,268 @@
+/*
+ * EU-tire-label - admission.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "admission.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Every running and waiting job holds a write lock on a single byte of the
+ * state file. Record locks are released by the kernel when the process
+ * dies, so crashed jobs never leak their slots. */
+#define ADMISSION_MAX_JOBS 256
+#define ADMISSION_MAX_QUEUE 1024
+
+/* Shared counters are stored in the first page of the state file, and lock
+ * bytes for running and waiting jobs follow it. */
+#define ADMISSION_COUNTERS_SIZE 4096
+#define ADMISSION_JOBS_OFFSET ADMISSION_COUNTERS_SIZE
+#define ADMISSION_QUEUE_OFFSET (ADMISSION_JOBS_OFFSET + ADMISSION_MAX_JOBS)
+
+/* Waiting jobs are served in the order of their tickets. The ticket of every
+ * waiting job is stored in the page following lock bytes, and it is valid
+ * only while the corresponding queue byte is locked. */
+#define ADMISSION_TICKETS_OFFSET 8192
+#define ADMISSION_FILE_SIZE (ADMISSION_TICKETS_OFFSET + ADMISSION_MAX_QUEUE * sizeof(uint64_t))
+
+/* polling interval range while waiting in the queue (in milliseconds) */
+#define ADMISSION_POLL_MIN 2
+#define ADMISSION_POLL_MAX 50
+
+struct admission_counters {
+	uint64_t admitted;
+	uint64_t shed_queue_full;
+	uint64_t shed_deadline;
+	/* last ticket handed out to a waiting job */
+	uint64_t tickets;
+};
+
+struct admission {
+	int fd;
+	struct admission_counters *counters;
+	uint64_t *tickets;
+	unsigned int jobs;
+	unsigned int queue;
+	/* offset of the acquired job lock or -1 */
+	off_t job;
+};
+
+static bool lock_byte(int fd, off_t offset) {
+	struct flock fl = {
+		.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1 };
+	return fcntl(fd, F_SETLK, &fl) == 0;
+}
+
+static void unlock_byte(int fd, off_t offset) {
+	struct flock fl = {
+		.l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1 };
+	fcntl(fd, F_SETLK, &fl);
+}
+
+/* Check whether given byte is locked by other process. */
+static bool is_locked_byte(int fd, off_t offset) {
+	struct flock fl = {
+		.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1 };
+	return fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+}
+
+/* Lock first free byte from the given range. Upon success this function
+ * returns the offset of the locked byte, otherwise -1. */
+static off_t lock_any_byte(int fd, off_t offset, unsigned int count) {
+	unsigned int i;
+	for (i = 0; i < count; i++)
+		if (lock_byte(fd, offset + i))
+			return offset + i;
+	return -1;
+}
+
+static long timespec_diff_ms(const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+/* Open admission control state shared by all processes which use the same
+ * state file. The jobs parameter limits the number of concurrently running
+ * jobs, and the queue parameter limits the number of waiting ones. */
+struct admission *admission_open(const char *path, unsigned int jobs, unsigned int queue) {
+
+	struct admission *admission;
+	struct stat st;
+
+	if ((admission = calloc(1, sizeof(*admission))) == NULL)
+		return NULL;
+
+	admission->fd = -1;
+	admission->job = -1;
+	admission->jobs = jobs < 1 ? 1 : jobs > ADMISSION_MAX_JOBS ? ADMISSION_MAX_JOBS : jobs;
+	admission->queue = queue > ADMISSION_MAX_QUEUE ? ADMISSION_MAX_QUEUE : queue;
+
+	if ((admission->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+		goto fail;
+
+	if (fstat(admission->fd, &st) == -1)
+		goto fail;
+	/* this operation is idempotent, so there is no race between processes */
+	if ((size_t)st.st_size < ADMISSION_FILE_SIZE &&
+			ftruncate(admission->fd, ADMISSION_FILE_SIZE) == -1)
+		goto fail;
+
+	if ((admission->counters = mmap(NULL, ADMISSION_FILE_SIZE, PROT_READ | PROT_WRITE,
+					MAP_SHARED, admission->fd, 0)) == MAP_FAILED) {
+		admission->counters = NULL;
+		goto fail;
+	}
+
+	admission->tickets = (uint64_t *)((unsigned char *)admission->counters +
+			ADMISSION_TICKETS_OFFSET);
+
+	return admission;
+
+fail:
+	admission_close(admission);
+	return NULL;
+}
+
+void admission_close(struct admission *admission) {
+	if (admission == NULL)
+		return;
+	admission_release(admission);
+	if (admission->counters != NULL)
+		munmap(admission->counters, ADMISSION_FILE_SIZE);
+	if (admission->fd != -1)
+		close(admission->fd);
+	free(admission);
+}
+
+/* Count waiting jobs with tickets older than the given one, up to the given
+ * limit. Tickets left behind by crashed processes are ignored, because their
+ * queue bytes are no longer locked. */
+static unsigned int count_older_waiters(struct admission *admission, off_t waiting,
+		uint64_t ticket, unsigned int limit) {
+
+	unsigned int i, count = 0;
+
+	for (i = 0; i < ADMISSION_MAX_QUEUE && count < limit; i++) {
+		const off_t offset = ADMISSION_QUEUE_OFFSET + i;
+		const uint64_t tmp = __atomic_load_n(&admission->tickets[i], __ATOMIC_ACQUIRE);
+		if (offset == waiting || tmp == 0 || tmp >= ticket)
+			continue;
+		if (is_locked_byte(admission->fd, offset))
+			count++;
+	}
+
+	return count;
+}
+
+static void leave_queue(struct admission *admission, off_t waiting) {
+	__atomic_store_n(&admission->tickets[waiting - ADMISSION_QUEUE_OFFSET], 0, __ATOMIC_RELEASE);
+	unlock_byte(admission->fd, waiting);
+}
+
+/* Acquire the job slot. If all slots are taken, wait in the bounded queue
+ * until the slot is released or the deadline (CLOCK_MONOTONIC) passes. New
+ * jobs do not overtake waiting ones, and free slots are handed out to the
+ * oldest waiting jobs first. */
+enum admission_status admission_acquire(struct admission *admission,
+		const struct timespec *deadline) {
+
+	unsigned int interval = ADMISSION_POLL_MIN;
+	struct timespec now;
+	uint64_t ticket;
+	off_t waiting;
+
+	if (count_older_waiters(admission, -1, UINT64_MAX, 1) == 0 &&
+			(admission->job = lock_any_byte(admission->fd,
+					ADMISSION_JOBS_OFFSET, admission->jobs)) != -1)
+		goto admitted;
+
+	if ((waiting = lock_any_byte(admission->fd,
+					ADMISSION_QUEUE_OFFSET, admission->queue)) == -1) {
+		__atomic_add_fetch(&admission->counters->shed_queue_full, 1, __ATOMIC_RELAXED);
+		return ADMISSION_QUEUE_FULL;
+	}
+
+	ticket = __atomic_add_fetch(&admission->counters->tickets, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&admission->tickets[waiting - ADMISSION_QUEUE_OFFSET], ticket,
+			__ATOMIC_RELEASE);
+
+	for (;;) {
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+			leave_queue(admission, waiting);
+			return ADMISSION_ERROR;
+		}
+
+		long remaining = timespec_diff_ms(deadline, &now);
+		if (remaining <= 0) {
+			leave_queue(admission, waiting);
+			__atomic_add_fetch(&admission->counters->shed_deadline, 1, __ATOMIC_RELAXED);
+			return ADMISSION_DEADLINE;
+		}
+
+		if ((long)interval > remaining)
+			interval = remaining;
+		struct timespec ts = { interval / 1000, (interval % 1000) * 1000000 };
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			continue;
+
+		/* Only jobs at the head of the queue compete for free slots. There
+		 * might be as many free slots as the number of all slots, so the head
+		 * spans that many waiting jobs. Jobs at the head poll at the highest
+		 * rate, so they are not outpaced by the exponential back-off. */
+		if (count_older_waiters(admission, waiting, ticket, admission->jobs) < admission->jobs) {
+			if ((admission->job = lock_any_byte(admission->fd,
+							ADMISSION_JOBS_OFFSET, admission->jobs)) != -1)
+				break;
+			interval = ADMISSION_POLL_MIN;
+			continue;
+		}
+
+		if ((interval *= 2) > ADMISSION_POLL_MAX)
+			interval = ADMISSION_POLL_MAX;
+	}
+
+	leave_queue(admission, waiting);
+
+admitted:
+	__atomic_add_fetch(&admission->counters->admitted, 1, __ATOMIC_RELAXED);
+	return ADMISSION_OK;
+}
+
+void admission_release(struct admission *admission) {
+	if (admission->job == -1)
+		return;
+	unlock_byte(admission->fd, admission->job);
+	admission->job = -1;
+}
+
+int admission_get_stats(struct admission *admission, struct admission_stats *stats) {
+
+	unsigned int i;
+
+	stats->running = 0;
+	for (i = 0; i < ADMISSION_MAX_JOBS; i++)
+		if (is_locked_byte(admission->fd, ADMISSION_JOBS_OFFSET + i))
+			stats->running++;
+
+	stats->waiting = 0;
+	for (i = 0; i < ADMISSION_MAX_QUEUE; i++)
+		if (is_locked_byte(admission->fd, ADMISSION_QUEUE_OFFSET + i))
+			stats->waiting++;
+
+	stats->admitted = __atomic_load_n(&admission->counters->admitted, __ATOMIC_RELAXED);
+	stats->shed_queue_full = __atomic_load_n(&admission->counters->shed_queue_full, __ATOMIC_RELAXED);
+	stats->shed_deadline = __atomic_load_n(&admission->counters->shed_deadline, __ATOMIC_RELAXED);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * EU-tire-label - admission.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_ADMISSION_H_
+#define EUTIRELABEL_ADMISSION_H_
+
+#include <stdint.h>
+#include <time.h>
+
+enum admission_status {
+	ADMISSION_OK = 0,
+	ADMISSION_QUEUE_FULL,
+	ADMISSION_DEADLINE,
+	ADMISSION_ERROR,
+};
+
+struct admission_stats {
+	/* number of running and waiting jobs */
+	unsigned int running;
+	unsigned int waiting;
+	/* total number of admitted and shed jobs */
+	uint64_t admitted;
+	uint64_t shed_queue_full;
+	uint64_t shed_deadline;
+};
+
+struct admission;
+
+struct admission *admission_open(const char *path, unsigned int jobs, unsigned int queue);
+void admission_close(struct admission *admission);
+
+enum admission_status admission_acquire(struct admission *admission,
+		const struct timespec *deadline);
+void admission_release(struct admission *admission);
+
+int admission_get_stats(struct admission *admission, struct admission_stats *stats);
+
+#endif
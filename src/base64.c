@@ -0,0 +1,176 @@
+/*
+ * EU-tire-label - base64.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "base64.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define BASE64_X86 1
+#endif
+
+static const char base64_alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if BASE64_X86
+/* Split 12 input bytes (in the lower 12 bytes of the vector) into sixteen
+ * 6-bit indices, one index per byte. */
+__attribute__((target("ssse3")))
+static inline __m128i base64_reshuffle_ssse3(__m128i v) {
+
+	v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	/* every 32-bit lane holds bytes [b1 b0 b2 b1] of the input triplet */
+	const __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003F03F0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+	return _mm_or_si128(t1, t3);
+}
+
+/* Translate 6-bit indices into base64 alphabet characters. Every index
+ * range (A-Z, a-z, 0-9, + and /) is shifted by a constant offset, which
+ * is looked up based on the index value. */
+__attribute__((target("ssse3")))
+static inline __m128i base64_translate_ssse3(__m128i v) {
+
+	const __m128i offsets = _mm_setr_epi8(
+			'A', 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 0, 0);
+
+	/* 0 for A-Z, 1 for a-z, 2-11 for 0-9, 12 for + and 13 for / */
+	__m128i idx = _mm_subs_epu8(v, _mm_set1_epi8(51));
+	idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(v, _mm_set1_epi8(25)));
+
+	return _mm_add_epi8(v, _mm_shuffle_epi8(offsets, idx));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i base64_reshuffle_avx2(__m256i v) {
+
+	v = _mm256_shuffle_epi8(v, _mm256_set_epi8(
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00));
+	const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0));
+	const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+
+	return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i base64_translate_avx2(__m256i v) {
+
+	const __m256i offsets = _mm256_setr_epi8(
+			'A', 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 0, 0,
+			'A', 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 0, 0);
+
+	__m256i idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+	idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+
+	return _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, idx));
+}
+#endif
+
+static char *base64_encode_scalar(char *dst, const unsigned char *src, size_t length) {
+
+	size_t i;
+
+	for (i = 0; i + 3 <= length; i += 3) {
+		uint32_t v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+		*dst++ = base64_alphabet[v >> 18];
+		*dst++ = base64_alphabet[(v >> 12) & 0x3F];
+		*dst++ = base64_alphabet[(v >> 6) & 0x3F];
+		*dst++ = base64_alphabet[v & 0x3F];
+	}
+
+	switch (length - i) {
+	case 1:
+		*dst++ = base64_alphabet[src[i] >> 2];
+		*dst++ = base64_alphabet[(src[i] & 0x03) << 4];
+		*dst++ = '=';
+		*dst++ = '=';
+		break;
+	case 2:
+		*dst++ = base64_alphabet[src[i] >> 2];
+		*dst++ = base64_alphabet[(src[i] & 0x03) << 4 | src[i + 1] >> 4];
+		*dst++ = base64_alphabet[(src[i + 1] & 0x0F) << 2];
+		*dst++ = '=';
+		break;
+	}
+
+	return dst;
+}
+
+#if BASE64_X86
+__attribute__((target("ssse3")))
+static char *base64_encode_ssse3(char *dst, const unsigned char *src, size_t length) {
+
+	size_t i = 0;
+
+	/* 12 input bytes per iteration, but the load is 16 bytes wide */
+	for (; i + 16 <= length; i += 12) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+		v = base64_translate_ssse3(base64_reshuffle_ssse3(v));
+		_mm_storeu_si128((__m128i *)dst, v);
+		dst += 16;
+	}
+
+	return base64_encode_scalar(dst, &src[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static char *base64_encode_avx2(char *dst, const unsigned char *src, size_t length) {
+
+	size_t i = 0;
+
+	/* 24 input bytes per iteration, but every 128-bit lane loads 16 bytes */
+	for (; i + 28 <= length; i += 24) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+					_mm_loadu_si128((const __m128i *)&src[i])),
+				_mm_loadu_si128((const __m128i *)&src[i + 12]), 1);
+		v = base64_translate_avx2(base64_reshuffle_avx2(v));
+		_mm256_storeu_si256((__m256i *)dst, v);
+		dst += 32;
+	}
+
+	return base64_encode_ssse3(dst, &src[i], length - i);
+}
+#endif
+
+/* Encoder selected at start-up according to the CPU features, so the
+ * default (baseline ISA) build uses the widest available vector unit. */
+static char *(*base64_encode_impl)(char *dst, const unsigned char *src,
+		size_t length) = base64_encode_scalar;
+
+__attribute__((constructor))
+static void base64_init(void) {
+#if BASE64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		base64_encode_impl = base64_encode_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		base64_encode_impl = base64_encode_ssse3;
+#endif
+}
+
+/* Encode data with the standard base64 alphabet and padding. The destination
+ * buffer shall be at least BASE64_LENGTH(length) bytes long. Returned value
+ * points to the end of the written data. Note, that the output is not
+ * null-terminated. */
+char *base64_encode(char *dst, const void *data, size_t length) {
+	return base64_encode_impl(dst, data, length);
+}
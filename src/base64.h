@@ -0,0 +1,22 @@
+/*
+ * EU-tire-label - base64.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_BASE64_H_
+#define EUTIRELABEL_BASE64_H_
+
+#include <stddef.h>
+
+/* Get the length of the base64 encoded data (without padding removal). */
+#define BASE64_LENGTH(n) (((n) + 2) / 3 * 4)
+
+char *base64_encode(char *dst, const void *data, size_t length);
+
+#endif
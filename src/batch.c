@@ -0,0 +1,673 @@
+/*
+ * EU-tire-label - batch.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "batch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalogue.h"
+#include "datauri.h"
+#include "output.h"
+
+/* maximal number of rendering threads */
+#define BATCH_MAX_JOBS 64
+
+struct batch_item {
+	/* index of the first equal record within the batch */
+	size_t unique;
+	struct batch_label label;
+	bool done;
+	bool ok;
+};
+
+struct batch {
+	/* records are stored in the catalogue in the input order */
+	struct catalogue *catalogue;
+	struct batch_item *items;
+	size_t count;
+	/* state shared with rendering threads */
+	const struct batch_renderer *renderer;
+	/* number of threads available for every rendered label */
+	unsigned int threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;
+	size_t next;
+};
+
+struct json {
+	const char *p;
+	const char *end;
+};
+
+static void json_skip_ws(struct json *json) {
+	while (json->p < json->end &&
+			(*json->p == ' ' || *json->p == '\t' || *json->p == '\n' || *json->p == '\r'))
+		json->p++;
+}
+
+static bool json_consume(struct json *json, char c) {
+	json_skip_ws(json);
+	if (json->p < json->end && *json->p == c) {
+		json->p++;
+		return true;
+	}
+	return false;
+}
+
+static int json_hex4(struct json *json, unsigned int *value) {
+
+	int i;
+
+	if (json->end - json->p < 4)
+		return -1;
+
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		char c = *json->p++;
+		*value <<= 4;
+		if (c >= '0' && c <= '9')
+			*value |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			*value |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			*value |= c - 'A' + 10;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Parse JSON string into the given buffer. Too long strings are silently
+ * truncated, so the buffer shall be bigger than the target field. */
+static int json_string(struct json *json, char *dst, size_t size) {
+
+	char tmp[4];
+	size_t i = 0;
+
+	if (!json_consume(json, '"'))
+		return -1;
+
+	while (json->p < json->end && *json->p != '"') {
+
+		const char *src = json->p++;
+		size_t n = 1;
+
+		if ((unsigned char)*src < 0x20)
+			return -1;
+
+		if (*src == '\\') {
+
+			if (json->p == json->end)
+				return -1;
+
+			src = tmp;
+			switch (*json->p++) {
+			case '"':
+			case '\\':
+			case '/':
+				tmp[0] = json->p[-1];
+				break;
+			case 'b':
+				tmp[0] = '\b';
+				break;
+			case 'f':
+				tmp[0] = '\f';
+				break;
+			case 'n':
+				tmp[0] = '\n';
+				break;
+			case 'r':
+				tmp[0] = '\r';
+				break;
+			case 't':
+				tmp[0] = '\t';
+				break;
+			case 'u': {
+				unsigned int cp, low;
+				if (json_hex4(json, &cp) == -1)
+					return -1;
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					if (json->end - json->p < 2 || json->p[0] != '\\' || json->p[1] != 'u')
+						return -1;
+					json->p += 2;
+					if (json_hex4(json, &low) == -1 || low < 0xDC00 || low > 0xDFFF)
+						return -1;
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else if (cp >= 0xDC00 && cp <= 0xDFFF)
+					return -1;
+				/* encode code point with UTF-8 */
+				if (cp < 0x80)
+					tmp[0] = cp;
+				else if (cp < 0x800) {
+					tmp[0] = 0xC0 | cp >> 6;
+					tmp[1] = 0x80 | (cp & 0x3F);
+					n = 2;
+				}
+				else if (cp < 0x10000) {
+					tmp[0] = 0xE0 | cp >> 12;
+					tmp[1] = 0x80 | ((cp >> 6) & 0x3F);
+					tmp[2] = 0x80 | (cp & 0x3F);
+					n = 3;
+				}
+				else {
+					tmp[0] = 0xF0 | cp >> 18;
+					tmp[1] = 0x80 | ((cp >> 12) & 0x3F);
+					tmp[2] = 0x80 | ((cp >> 6) & 0x3F);
+					tmp[3] = 0x80 | (cp & 0x3F);
+					n = 4;
+				}
+				break;
+			}
+			default:
+				return -1;
+			}
+
+		}
+
+		if (i + n < size) {
+			memcpy(&dst[i], src, n);
+			i += n;
+		}
+
+	}
+
+	if (json->p == json->end)
+		return -1;
+
+	json->p++;
+	dst[i] = '\0';
+	return 0;
+}
+
+/* Parse JSON scalar value (string, number, boolean or null) and store its
+ * textual representation in the given buffer. Null is stored as an empty
+ * string. */
+static int json_scalar(struct json *json, char *dst, size_t size) {
+
+	json_skip_ws(json);
+	if (json->p == json->end)
+		return -1;
+
+	if (*json->p == '"')
+		return json_string(json, dst, size);
+
+	const char *start = json->p;
+	while (json->p < json->end && strchr("+-.0123456789Eaeflnrstu", *json->p) != NULL)
+		json->p++;
+
+	size_t length = json->p - start;
+	if (length == 0 || length >= size)
+		return -1;
+
+	memcpy(dst, start, length);
+	dst[length] = '\0';
+
+	if (strcmp(dst, "null") == 0)
+		dst[0] = '\0';
+	else if (strcmp(dst, "true") != 0 && strcmp(dst, "false") != 0 &&
+			strspn(dst, "+-.0123456789Ee") != length)
+		return -1;
+
+	return 0;
+}
+
+static int json_skip_value(struct json *json, unsigned int depth) {
+
+	char tmp[64];
+
+	if (depth > 16)
+		return -1;
+
+	if (json_consume(json, '{')) {
+		if (json_consume(json, '}'))
+			return 0;
+		do {
+			json_skip_ws(json);
+			if (json_string(json, tmp, sizeof(tmp)) == -1 ||
+					!json_consume(json, ':') ||
+					json_skip_value(json, depth + 1) == -1)
+				return -1;
+		} while (json_consume(json, ','));
+		return json_consume(json, '}') ? 0 : -1;
+	}
+
+	if (json_consume(json, '[')) {
+		if (json_consume(json, ']'))
+			return 0;
+		do {
+			if (json_skip_value(json, depth + 1) == -1)
+				return -1;
+		} while (json_consume(json, ','));
+		return json_consume(json, ']') ? 0 : -1;
+	}
+
+	/* long strings are consumed and truncated */
+	return json_scalar(json, tmp, sizeof(tmp));
+}
+
+static bool is_true(const char *value) {
+	return strcmp(value, "true") == 0 || atoi(value) != 0;
+}
+
+/* Copy string into the fixed-size label field. Too long strings are
+ * truncated, and the result is always null-terminated. */
+static void copy_field(char *dst, size_t size, const char *value) {
+	size_t len = strlen(value);
+	if (len >= size)
+		len = size - 1;
+	memcpy(dst, value, len);
+	dst[len] = '\0';
+}
+
+/* Parse single label record. Keys are the same as the long command line
+ * options, e.g. {"tire-class": 1, "fuel-efficiency": "B", "ice-grip": true}.
+ * Unknown keys are ignored. */
+static int batch_parse_record(struct json *json, struct eu_tire_label *data) {
+
+	char key[32];
+	char value[256];
+
+	if (!json_consume(json, '{'))
+		return -1;
+	if (json_consume(json, '}'))
+		return 0;
+
+	do {
+
+		json_skip_ws(json);
+		if (json_string(json, key, sizeof(key)) == -1 ||
+				!json_consume(json, ':'))
+			return -1;
+
+		json_skip_ws(json);
+		if (json->p < json->end && (*json->p == '{' || *json->p == '[')) {
+			if (json_skip_value(json, 0) == -1)
+				return -1;
+			continue;
+		}
+
+		if (json_scalar(json, value, sizeof(value)) == -1)
+			return -1;
+
+		if (strcmp(key, "svg-title") == 0)
+			copy_field(data->title, sizeof(data->title), value);
+		else if (strcmp(key, "eprel-url") == 0)
+			copy_field(data->qrcode, sizeof(data->qrcode), value);
+		else if (strcmp(key, "trademark") == 0)
+			copy_field(data->trademark, sizeof(data->trademark), value);
+		else if (strcmp(key, "tire-type") == 0)
+			copy_field(data->tire_type, sizeof(data->tire_type), value);
+		else if (strcmp(key, "tire-size") == 0)
+			copy_field(data->tire_size, sizeof(data->tire_size), value);
+		else if (strcmp(key, "tire-class") == 0)
+			data->tire_class = parse_tire_class(value);
+		else if (strcmp(key, "fuel-efficiency") == 0)
+			data->fuel_efficiency = parse_fuel_efficiency_class(value);
+		else if (strcmp(key, "wet-grip") == 0)
+			data->wet_grip = parse_wet_grip_class(value);
+		else if (strcmp(key, "rolling-noise") == 0)
+			data->rolling_noise = parse_rolling_noise_class(value);
+		else if (strcmp(key, "rolling-noise-db") == 0)
+			data->rolling_noise_db = parse_rolling_noise_db(value);
+		else if (strcmp(key, "snow-grip") == 0)
+			data->snow_grip = is_true(value);
+		else if (strcmp(key, "ice-grip") == 0)
+			data->ice_grip = is_true(value);
+
+	} while (json_consume(json, ','));
+
+	return json_consume(json, '}') ? 0 : -1;
+}
+
+/* Parse JSON array of label records. Upon error this function returns NULL
+ * and sets errno to EINVAL (malformed input) or ENOMEM. */
+struct batch *batch_parse(const char *json_data, size_t length) {
+
+	struct json json = { json_data, &json_data[length] };
+	struct batch *batch;
+	uint32_t *slots = NULL;
+	size_t slots_size = 1;
+	size_t i, j;
+
+	if ((batch = calloc(1, sizeof(*batch))) == NULL)
+		return NULL;
+
+	if ((batch->catalogue = catalogue_new()) == NULL ||
+			(batch->items = calloc(BATCH_MAX_RECORDS, sizeof(*batch->items))) == NULL)
+		goto fail_nomem;
+
+	if (!json_consume(&json, '['))
+		goto fail;
+
+	if (!json_consume(&json, ']')) {
+		do {
+
+			struct eu_tire_label data = { 0 };
+
+			if (batch->count == BATCH_MAX_RECORDS) {
+				fprintf(stderr, "error: too many batch records\n");
+				goto fail;
+			}
+
+			if (batch_parse_record(&json, &data) == -1) {
+				fprintf(stderr, "error: malformed batch record: %zu\n", batch->count);
+				goto fail;
+			}
+
+			if (data.tire_class == TC_ERROR) {
+				fprintf(stderr, "error: batch record %zu: tire class is required\n", batch->count);
+				goto fail;
+			}
+
+			if (catalogue_add(batch->catalogue, &data, NULL) == -1)
+				goto fail_nomem;
+			batch->count++;
+
+		} while (json_consume(&json, ','));
+		if (!json_consume(&json, ']'))
+			goto fail;
+	}
+
+	json_skip_ws(&json);
+	if (json.p != json.end)
+		goto fail;
+
+	/* Duplicated records are rendered only once. Unique records are kept
+	 * in the open addressing hash table (with record indexes + 1), so only
+	 * records with colliding hashes are compared. */
+	while (slots_size < batch->count * 2)
+		slots_size *= 2;
+	if ((slots = calloc(slots_size, sizeof(*slots))) == NULL)
+		goto fail_nomem;
+	for (i = 0; i < batch->count; i++) {
+		batch->items[i].unique = i;
+		for (j = catalogue_hash(batch->catalogue, i) & (slots_size - 1); slots[j] != 0;
+				j = (j + 1) & (slots_size - 1))
+			if (catalogue_equal(batch->catalogue, i, slots[j] - 1)) {
+				batch->items[i].unique = slots[j] - 1;
+				break;
+			}
+		if (slots[j] == 0)
+			slots[j] = i + 1;
+	}
+
+	free(slots);
+	return batch;
+
+fail:
+	batch_free(batch);
+	errno = EINVAL;
+	return NULL;
+fail_nomem:
+	free(slots);
+	batch_free(batch);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void batch_free(struct batch *batch) {
+	if (batch == NULL)
+		return;
+	catalogue_free(batch->catalogue);
+	free(batch->items);
+	free(batch);
+}
+
+/* Render unique records in the input order, so the response can be started
+ * as soon as the first label is ready. */
+static void *batch_worker(void *arg) {
+
+	struct batch *batch = (struct batch *)arg;
+	const struct batch_renderer *renderer = batch->renderer;
+
+	for (;;) {
+
+		pthread_mutex_lock(&batch->mutex);
+		while (batch->next < batch->count &&
+				batch->items[batch->next].unique != batch->next)
+			batch->next++;
+		if (batch->next == batch->count) {
+			pthread_mutex_unlock(&batch->mutex);
+			break;
+		}
+		const size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
+
+		struct eu_tire_label data;
+		struct batch_label label = { 0 };
+		catalogue_get(batch->catalogue, i, &data);
+		bool ok = renderer->render(&data, &label, batch->threads, renderer->userdata) == 0;
+
+		pthread_mutex_lock(&batch->mutex);
+		batch->items[i].label = label;
+		batch->items[i].ok = ok;
+		batch->items[i].done = true;
+		pthread_cond_broadcast(&batch->ready);
+		pthread_mutex_unlock(&batch->mutex);
+
+	}
+
+	return NULL;
+}
+
+static void batch_boundary(char *boundary, size_t size) {
+
+	uint64_t value;
+	int fd;
+
+	if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) == -1 ||
+			read(fd, &value, sizeof(value)) != sizeof(value)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		value = (uint64_t)ts.tv_sec << 32 ^ ts.tv_nsec ^ (uint64_t)getpid() << 48;
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	snprintf(boundary, size, "eu-tire-label-%016llx", (unsigned long long)value);
+}
+
+static int batch_write_item(const struct batch *batch, size_t index,
+		enum batch_encoding encoding, const char *boundary, int fd) {
+
+	const struct batch_renderer *renderer = batch->renderer;
+	const struct batch_item *item = &batch->items[batch->items[index].unique];
+	const bool first = index == 0;
+	/* SVG labels are embedded with percent-encoding, which is smaller than
+	 * base64 for the mostly ASCII text */
+	const enum datauri_encoding uri_encoding = strcmp(renderer->content_type,
+			"image/svg+xml") == 0 ? DATAURI_PERCENT : DATAURI_BASE64;
+	const struct iovec label = { (void *)item->label.data, item->label.length };
+	struct eu_tire_label data;
+	struct iovec iov[3];
+	char header[256];
+	char *encoded = NULL;
+	size_t length;
+	char *p;
+	int rv;
+
+	switch (encoding) {
+	case BATCH_MULTIPART:
+		if (!item->ok) {
+			snprintf(header, sizeof(header), "--%s\r\n"
+					"Content-Type: text/plain\r\nContent-Length: 5\r\n\r\n" "error\r\n",
+					boundary);
+			iov[0].iov_base = header;
+			iov[0].iov_len = strlen(header);
+			return output_writev(fd, iov, 1);
+		}
+		snprintf(header, sizeof(header), "--%s\r\n"
+				"Content-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+				boundary, renderer->content_type, item->label.length);
+		iov[0].iov_base = header;
+		iov[0].iov_len = strlen(header);
+		iov[1].iov_base = (void *)item->label.data;
+		iov[1].iov_len = item->label.length;
+		iov[2].iov_base = "\r\n";
+		iov[2].iov_len = 2;
+		return output_writev(fd, iov, 3);
+	case BATCH_JSON:
+		if (!item->ok) {
+			iov[0].iov_base = first ? "null" : ",null";
+			iov[0].iov_len = strlen(iov[0].iov_base);
+			return output_writev(fd, iov, 1);
+		}
+		if ((encoded = malloc(datauri_length(renderer->content_type,
+							&label, 1, uri_encoding) + 3)) == NULL)
+			return -1;
+		p = encoded;
+		if (!first)
+			*p++ = ',';
+		*p++ = '"';
+		p = datauri_copy(p, renderer->content_type, &label, 1, uri_encoding);
+		*p++ = '"';
+		iov[0].iov_base = encoded;
+		iov[0].iov_len = p - encoded;
+		rv = output_writev(fd, iov, 1);
+		free(encoded);
+		return rv;
+	case BATCH_HTML:
+		if (!item->ok) {
+			iov[0].iov_base = "<!-- error -->\n";
+			iov[0].iov_len = strlen(iov[0].iov_base);
+			return output_writev(fd, iov, 1);
+		}
+		catalogue_get(batch->catalogue, index, &data);
+		if ((encoded = datauri_img_dup(renderer->content_type, &label, 1, uri_encoding,
+						data.title[0] != '\0' ? data.title : "EU tire label",
+						renderer->width, renderer->height, &length)) == NULL)
+			return -1;
+		iov[0].iov_base = encoded;
+		iov[0].iov_len = length;
+		iov[1].iov_base = "\n";
+		iov[1].iov_len = 1;
+		rv = output_writev(fd, iov, 2);
+		free(encoded);
+		return rv;
+	}
+
+	return -1;
+}
+
+/* Render all labels and write the CGI response to the given file descriptor.
+ * Labels are written in the input order as soon as they are ready. */
+int batch_respond(struct batch *batch, const struct batch_renderer *renderer,
+		enum batch_encoding encoding, unsigned int jobs, int fd) {
+
+	pthread_t threads[BATCH_MAX_JOBS];
+	unsigned int threads_count = 0;
+	char boundary[64] = "";
+	char header[256];
+	struct iovec iov;
+	size_t i, unique = 0;
+	int rv = 0;
+
+	batch->renderer = renderer;
+	batch->next = 0;
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->ready, NULL);
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->items[i].unique == i)
+			unique++;
+
+	const unsigned int cpus = jobs;
+	if (jobs > unique)
+		jobs = unique;
+	if (jobs > BATCH_MAX_JOBS)
+		jobs = BATCH_MAX_JOBS;
+	/* CPUs not used by workers are shared among rendered labels */
+	batch->threads = jobs > 0 ? cpus / jobs : cpus;
+	if (batch->threads < 1)
+		batch->threads = 1;
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&threads[threads_count], NULL, batch_worker, batch) == 0)
+			threads_count++;
+	/* fall back to rendering in the calling thread */
+	if (threads_count == 0)
+		batch_worker(batch);
+
+	switch (encoding) {
+	case BATCH_MULTIPART:
+		batch_boundary(boundary, sizeof(boundary));
+		snprintf(header, sizeof(header), "Status: 200 OK\r\n"
+				"Content-Type: multipart/mixed; boundary=%s\r\n\r\n", boundary);
+		break;
+	case BATCH_JSON:
+		snprintf(header, sizeof(header), "Status: 200 OK\r\n"
+				"Content-Type: application/json\r\n\r\n" "{\"labels\":[");
+		break;
+	case BATCH_HTML:
+		snprintf(header, sizeof(header), "Status: 200 OK\r\n"
+				"Content-Type: text/html; charset=utf-8\r\n\r\n");
+		break;
+	}
+
+	iov.iov_base = header;
+	iov.iov_len = strlen(header);
+	if (output_writev(fd, &iov, 1) == -1)
+		rv = -1;
+
+	for (i = 0; i < batch->count; i++) {
+
+		struct batch_item *item = &batch->items[batch->items[i].unique];
+
+		pthread_mutex_lock(&batch->mutex);
+		while (!item->done)
+			pthread_cond_wait(&batch->ready, &batch->mutex);
+		pthread_mutex_unlock(&batch->mutex);
+
+		/* keep rendering even if the client went away, so all workers
+		 * finish and release their resources */
+		if (rv == 0 && batch_write_item(batch, i, encoding, boundary, fd) == -1)
+			rv = -1;
+
+	}
+
+	switch (encoding) {
+	case BATCH_MULTIPART:
+		snprintf(header, sizeof(header), "--%s--\r\n", boundary);
+		break;
+	case BATCH_JSON:
+		snprintf(header, sizeof(header), "]}\n");
+		break;
+	case BATCH_HTML:
+		header[0] = '\0';
+		break;
+	}
+
+	iov.iov_base = header;
+	iov.iov_len = strlen(header);
+	if (rv == 0 && output_writev(fd, &iov, 1) == -1)
+		rv = -1;
+
+	for (i = 0; i < threads_count; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->items[i].ok)
+			renderer->release(&batch->items[i].label, renderer->userdata);
+
+	pthread_cond_destroy(&batch->ready);
+	pthread_mutex_destroy(&batch->mutex);
+	return rv;
+}
@@ -0,0 +1,63 @@
+/*
+ * EU-tire-label - batch.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_BATCH_H_
+#define EUTIRELABEL_BATCH_H_
+
+#include <stddef.h>
+
+#include "label.h"
+
+/* maximal number of records in a single batch */
+#define BATCH_MAX_RECORDS 1000
+/* maximal length of the JSON request body */
+#define BATCH_MAX_LENGTH (1024 * 1024)
+
+enum batch_encoding {
+	/* every label as a separate part of the multipart/mixed body */
+	BATCH_MULTIPART = 0,
+	/* JSON object with an array of data URIs */
+	BATCH_JSON,
+	/* HTML image elements with embedded data URIs, one per line */
+	BATCH_HTML,
+};
+
+struct batch_label {
+	const void *data;
+	size_t length;
+	/* opaque handle passed to the release callback */
+	void *handle;
+};
+
+/* Rendering callbacks might be called concurrently from many threads. */
+struct batch_renderer {
+	const char *content_type;
+	/* The threads parameter is the number of threads which the renderer
+	 * may use for a single label, so labels rendered in parallel do not
+	 * oversubscribe CPUs. */
+	int (*render)(const struct eu_tire_label *data, struct batch_label *label,
+			unsigned int threads, void *userdata);
+	void (*release)(struct batch_label *label, void *userdata);
+	void *userdata;
+	/* dimensions announced in HTML image elements (if positive) */
+	int width;
+	int height;
+};
+
+struct batch;
+
+struct batch *batch_parse(const char *json, size_t length);
+void batch_free(struct batch *batch);
+
+int batch_respond(struct batch *batch, const struct batch_renderer *renderer,
+		enum batch_encoding encoding, unsigned int jobs, int fd);
+
+#endif
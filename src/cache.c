@@ -0,0 +1,450 @@
+/*
+ * EU-tire-label - cache.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x4C545545 /* "EUTL" */
+#define CACHE_VERSION 1
+
+/* The cache is organized as a set-associative array of fixed-size slots.
+ * Within a set, victims are selected with the clock algorithm. */
+#define CACHE_SETS 64
+#define CACHE_WAYS 8
+#define CACHE_SLOT_SIZE (64 * 1024)
+
+/* Number of record locks used for coalescing concurrent renders of the same
+ * label. Locks are placed beyond the end of the cache file. */
+#define CACHE_FLIGHT_LOCKS 65536
+
+/* polling interval range while waiting for other render (in milliseconds) */
+#define CACHE_FLIGHT_POLL_MIN 2
+#define CACHE_FLIGHT_POLL_MAX 50
+
+/* Time after which a slot locked by a writer is considered abandoned
+ * (e.g. the writer process crashed in the middle of the write). */
+#define CACHE_LOCK_TIMEOUT 10
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sets;
+	uint32_t ways;
+	uint32_t slot_size;
+	/* clock hand for every set */
+	uint32_t hands[CACHE_SETS];
+};
+
+/* Slots are protected with the sequence lock. Odd sequence number means
+ * that the write is in progress, and readers shall skip such a slot. */
+struct cache_slot {
+	uint32_t seq;
+	uint32_t referenced;
+	int64_t lock_time;
+	uint64_t hash;
+	uint64_t checksum;
+	uint32_t key_length;
+	uint32_t data_length;
+	unsigned char key[CACHE_KEY_MAX];
+	unsigned char data[];
+};
+
+#define CACHE_DATA_MAX (CACHE_SLOT_SIZE - sizeof(struct cache_slot))
+#define CACHE_SLOTS_OFFSET ((sizeof(struct cache_header) + 4095) & ~(size_t)4095)
+#define CACHE_FILE_SIZE (CACHE_SLOTS_OFFSET + (size_t)CACHE_SETS * CACHE_WAYS * CACHE_SLOT_SIZE)
+
+struct cache {
+	int fd;
+	unsigned char *map;
+	struct cache_header *header;
+	/* offset of the acquired flight lock or -1 */
+	off_t flight;
+};
+
+/* FNV-1a hash function. */
+static uint64_t cache_hash(uint64_t hash, const void *data, size_t length) {
+	const unsigned char *p = data;
+	while (length--) {
+		hash ^= *p++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+#define CACHE_HASH_INIT 0xCBF29CE484222325ULL
+
+static struct cache_slot *cache_slot(struct cache *cache, size_t set, size_t way) {
+	size_t index = set * CACHE_WAYS + way;
+	return (struct cache_slot *)&cache->map[CACHE_SLOTS_OFFSET + index * CACHE_SLOT_SIZE];
+}
+
+/* Check whether the mapped cache file has the expected layout. */
+static bool cache_valid(const struct cache_header *header) {
+	return __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == CACHE_MAGIC &&
+		header->version == CACHE_VERSION &&
+		header->sets == CACHE_SETS &&
+		header->ways == CACHE_WAYS &&
+		header->slot_size == CACHE_SLOT_SIZE;
+}
+
+/* Create new zero-filled cache file and atomically replace the old one with
+ * it. The old file is never truncated, because other processes (e.g. an
+ * older binary during a rolling upgrade) might still have it mapped, and
+ * accessing pages beyond the end of the file would raise SIGBUS. */
+static int cache_create(const char *path) {
+
+	const struct cache_header header = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.sets = CACHE_SETS,
+		.ways = CACHE_WAYS,
+		.slot_size = CACHE_SLOT_SIZE,
+	};
+
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = mkstemp(tmp)) == -1)
+		return -1;
+
+	if (ftruncate(fd, CACHE_FILE_SIZE) == -1 ||
+			pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			rename(tmp, path) == -1) {
+		unlink(tmp);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Open (and create if needed) the cache file. It is advised to place the
+ * cache file on a memory-backed file system, e.g. /dev/shm. Upon failure
+ * this function returns NULL. */
+struct cache *cache_open(const char *path) {
+
+	struct cache *cache;
+	struct stat st, st_path;
+	int fd = -1;
+	int attempt;
+
+	if ((cache = calloc(1, sizeof(*cache))) == NULL)
+		return NULL;
+
+	cache->fd = -1;
+	cache->flight = -1;
+
+	/* Validate cache layout, and (re)create the file if needed. The file lock
+	 * is taken only in such a case, so the hot path is lock-free. Number of
+	 * attempts is limited, so processes with different cache layouts can not
+	 * replace each other's files forever. */
+	for (attempt = 0; attempt < 3; attempt++) {
+
+		if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+			goto fail;
+
+		if (fstat(fd, &st) == -1)
+			goto fail;
+
+		if ((size_t)st.st_size == CACHE_FILE_SIZE) {
+			if ((cache->map = mmap(NULL, CACHE_FILE_SIZE, PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0)) == MAP_FAILED) {
+				cache->map = NULL;
+				goto fail;
+			}
+			cache->header = (struct cache_header *)cache->map;
+			if (cache_valid(cache->header)) {
+				cache->fd = fd;
+				return cache;
+			}
+			munmap(cache->map, CACHE_FILE_SIZE);
+			cache->map = NULL;
+		}
+
+		if (flock(fd, LOCK_EX) == -1)
+			goto fail;
+
+		/* the file might have been replaced by other process in the meantime,
+		 * in such case simply open the new one */
+		if (stat(path, &st_path) == 0 &&
+				st_path.st_dev == st.st_dev && st_path.st_ino == st.st_ino &&
+				cache_create(path) == -1) {
+			flock(fd, LOCK_UN);
+			goto fail;
+		}
+
+		flock(fd, LOCK_UN);
+		close(fd);
+		fd = -1;
+
+	}
+
+	errno = EAGAIN;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	cache_close(cache);
+	return NULL;
+}
+
+void cache_close(struct cache *cache) {
+	if (cache == NULL)
+		return;
+	cache_flight_end(cache);
+	if (cache->map != NULL)
+		munmap(cache->map, CACHE_FILE_SIZE);
+	if (cache->fd != -1)
+		close(cache->fd);
+	free(cache);
+}
+
+/* Create canonical cache key for the given label data and output format.
+ * The key buffer shall be at least CACHE_KEY_MAX bytes long. */
+size_t cache_label_key(unsigned char *key, const struct eu_tire_label *data,
+		bool label_EU_2020_740, int format, int width, int height, int effort) {
+
+	const uint64_t template_id = label_template_id();
+	const char *strings[] = {
+#ifdef VERSION
+		VERSION,
+#endif
+		data->title, data->qrcode, data->trademark, data->tire_type, data->tire_size };
+	const int values[] = {
+		label_EU_2020_740, format, width, height, effort,
+		data->tire_class, data->fuel_efficiency, data->wet_grip, data->rolling_noise,
+		data->rolling_noise_db, data->snow_grip, data->ice_grip };
+	unsigned char *p = key;
+	size_t i;
+
+	/* Strings are stored with terminating null character, so it is not
+	 * possible to create the same key by shifting text between fields. */
+	for (i = 0; i < sizeof(strings) / sizeof(*strings); i++) {
+		size_t len = strlen(strings[i]);
+		memcpy(p, strings[i], len);
+		p[len] = '\0';
+		p += len + 1;
+	}
+
+	memcpy(p, values, sizeof(values));
+	p += sizeof(values);
+	memcpy(p, &template_id, sizeof(template_id));
+	p += sizeof(template_id);
+
+	return p - key;
+}
+
+/* Lookup the cache for the given key. Memory for the data is obtained with
+ * malloc(3), and can be freed with free(3). If there is no (valid) entry
+ * for the key, this function returns NULL. */
+void *cache_get(struct cache *cache, const unsigned char *key, size_t key_length,
+		size_t *length) {
+
+	const uint64_t hash = cache_hash(CACHE_HASH_INIT, key, key_length);
+	const size_t set = hash % CACHE_SETS;
+	size_t way;
+
+	for (way = 0; way < CACHE_WAYS; way++) {
+
+		struct cache_slot *slot = cache_slot(cache, set, way);
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		unsigned char *data;
+		size_t data_length;
+
+		if (seq == 0 || seq & 1)
+			continue;
+		if (slot->hash != hash ||
+				slot->key_length != key_length ||
+				memcmp(slot->key, key, key_length) != 0)
+			continue;
+
+		if ((data_length = slot->data_length) > CACHE_DATA_MAX)
+			continue;
+		if ((data = malloc(data_length + 1)) == NULL)
+			return NULL;
+
+		memcpy(data, slot->data, data_length);
+		uint64_t checksum = slot->checksum;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+				cache_hash(hash, data, data_length) != checksum) {
+			/* slot was modified during read or it is corrupted */
+			free(data);
+			continue;
+		}
+
+		__atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+
+		data[data_length] = '\0';
+		*length = data_length;
+		return data;
+	}
+
+	return NULL;
+}
+
+/* Store data in the cache. Data which does not fit into a single slot is
+ * not cached. Upon failure (e.g. selected slot is being written by other
+ * process) this function returns -1. */
+int cache_put(struct cache *cache, const unsigned char *key, size_t key_length,
+		const void *data, size_t length) {
+
+	const uint64_t hash = cache_hash(CACHE_HASH_INIT, key, key_length);
+	const size_t set = hash % CACHE_SETS;
+	struct cache_slot *slot = NULL;
+	uint32_t hand;
+	size_t i;
+
+	if (key_length > CACHE_KEY_MAX || length > CACHE_DATA_MAX)
+		return -1;
+
+	/* select victim slot with the clock algorithm */
+	hand = __atomic_load_n(&cache->header->hands[set], __ATOMIC_RELAXED) % CACHE_WAYS;
+	for (i = 0; i < 2 * CACHE_WAYS; i++, hand = (hand + 1) % CACHE_WAYS) {
+		slot = cache_slot(cache, set, hand);
+		if (__atomic_exchange_n(&slot->referenced, 0, __ATOMIC_RELAXED) == 0)
+			break;
+	}
+	__atomic_store_n(&cache->header->hands[set], (hand + 1) % CACHE_WAYS, __ATOMIC_RELAXED);
+
+	/* acquire the slot lock - steal it if the owner seems to be dead */
+	const int64_t now = time(NULL);
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	uint32_t locked = seq + 1;
+	if (seq & 1) {
+		if (now - __atomic_load_n(&slot->lock_time, __ATOMIC_RELAXED) < CACHE_LOCK_TIMEOUT)
+			return -1;
+		locked = seq + 2;
+	}
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, locked,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return -1;
+	__atomic_store_n(&slot->lock_time, now, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->hash = hash;
+	slot->key_length = key_length;
+	memcpy(slot->key, key, key_length);
+	slot->data_length = length;
+	memcpy(slot->data, data, length);
+	slot->checksum = cache_hash(hash, data, length);
+	__atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->seq, locked + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static off_t cache_flight_offset(const unsigned char *key, size_t key_length) {
+	return CACHE_FILE_SIZE + cache_hash(CACHE_HASH_INIT, key, key_length) % CACHE_FLIGHT_LOCKS;
+}
+
+static bool cache_flight_trylock(struct cache *cache, off_t offset) {
+	struct flock fl = {
+		.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1 };
+	return fcntl(cache->fd, F_SETLK, &fl) == 0;
+}
+
+static void cache_flight_unlock(struct cache *cache, off_t offset) {
+	struct flock fl = {
+		.l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1 };
+	fcntl(cache->fd, F_SETLK, &fl);
+}
+
+/* Begin rendering of the label identified by the given key. If no other
+ * process renders the same label, the caller becomes the leader and shall
+ * call cache_flight_end() after storing rendered label in the cache. The
+ * lock is released by the kernel if the leader process dies. */
+enum cache_flight cache_flight_begin(struct cache *cache,
+		const unsigned char *key, size_t key_length) {
+
+	off_t offset = cache_flight_offset(key, key_length);
+
+	if (!cache_flight_trylock(cache, offset))
+		return CACHE_FLIGHT_WAIT;
+
+	cache->flight = offset;
+	return CACHE_FLIGHT_LEADER;
+}
+
+void cache_flight_end(struct cache *cache) {
+	if (cache->flight == -1)
+		return;
+	cache_flight_unlock(cache, cache->flight);
+	cache->flight = -1;
+}
+
+/* Wait for the leader to finish rendering of the label and return its
+ * result from the cache. If the leader finished without storing the label
+ * in the cache (e.g. it was too big or the leader crashed), this function
+ * returns NULL and sets errno to ENOENT. If the deadline (CLOCK_MONOTONIC)
+ * passes, errno is set to ETIMEDOUT. */
+void *cache_flight_wait(struct cache *cache, const unsigned char *key, size_t key_length,
+		size_t *length, const struct timespec *deadline) {
+
+	const off_t offset = cache_flight_offset(key, key_length);
+	unsigned int interval = CACHE_FLIGHT_POLL_MIN;
+	struct timespec now;
+	void *data;
+
+	for (;;) {
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+			return NULL;
+
+		long remaining = (deadline->tv_sec - now.tv_sec) * 1000 +
+			(deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if (remaining <= 0) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+
+		if ((long)interval > remaining)
+			interval = remaining;
+		struct timespec ts = { interval / 1000, (interval % 1000) * 1000000 };
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			continue;
+
+		if ((data = cache_get(cache, key, key_length, length)) != NULL)
+			return data;
+
+		/* the leader has finished but the label is not in the cache */
+		if (cache_flight_trylock(cache, offset)) {
+			cache_flight_unlock(cache, offset);
+			if ((data = cache_get(cache, key, key_length, length)) != NULL)
+				return data;
+			errno = ENOENT;
+			return NULL;
+		}
+
+		if ((interval *= 2) > CACHE_FLIGHT_POLL_MAX)
+			interval = CACHE_FLIGHT_POLL_MAX;
+	}
+
+}
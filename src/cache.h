@@ -0,0 +1,53 @@
+/*
+ * EU-tire-label - cache.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_CACHE_H_
+#define EUTIRELABEL_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "label.h"
+
+/* maximal length of the canonical cache key */
+#define CACHE_KEY_MAX 512
+
+enum cache_flight {
+	CACHE_FLIGHT_LEADER,
+	CACHE_FLIGHT_WAIT,
+};
+
+struct cache;
+
+struct cache *cache_open(const char *path);
+void cache_close(struct cache *cache);
+
+/* Create the canonical cache key for the label. The effort parameter is
+ * the format-specific encoder setting, which affects the output (e.g. the
+ * WebP compression effort), or 0 if not applicable. The key includes the
+ * program version and the identity of label templates, so labels rendered
+ * by other builds sharing the cache file are never served. */
+size_t cache_label_key(unsigned char *key, const struct eu_tire_label *data,
+		bool label_EU_2020_740, int format, int width, int height, int effort);
+
+void *cache_get(struct cache *cache, const unsigned char *key, size_t key_length,
+		size_t *length);
+int cache_put(struct cache *cache, const unsigned char *key, size_t key_length,
+		const void *data, size_t length);
+
+enum cache_flight cache_flight_begin(struct cache *cache,
+		const unsigned char *key, size_t key_length);
+void cache_flight_end(struct cache *cache);
+void *cache_flight_wait(struct cache *cache, const unsigned char *key, size_t key_length,
+		size_t *length, const struct timespec *deadline);
+
+#endif
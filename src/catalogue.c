@@ -0,0 +1,347 @@
+/*
+ * EU-tire-label - catalogue.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "catalogue.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Class fields are bit-packed into a single 32-bit word per record. */
+#define PACK_TIRE_CLASS_SHIFT 0
+#define PACK_FUEL_EFFICIENCY_SHIFT 2
+#define PACK_WET_GRIP_SHIFT 5
+#define PACK_ROLLING_NOISE_SHIFT 8
+#define PACK_SNOW_GRIP_SHIFT 10
+#define PACK_ICE_GRIP_SHIFT 11
+#define PACK_ROLLING_NOISE_DB_SHIFT 12
+
+/* Trademarks, tire types and sizes repeat across the catalogue, so every
+ * distinct string is stored only once. Strings are referenced by their IDs,
+ * and the ID 0 is always an empty string. */
+struct catalogue_strings {
+	char *pool;
+	size_t pool_length;
+	size_t pool_size;
+	/* offset of every string, offsets[count] is the end of the pool */
+	uint32_t *offsets;
+	uint32_t count;
+	uint32_t size;
+	/* open addressing hash table with string IDs + 1 */
+	uint32_t *slots;
+	uint32_t slots_size;
+};
+
+/* Records are stored column-wise, so scanning a single field touches only
+ * a small contiguous array. */
+struct catalogue {
+	size_t count;
+	size_t size;
+	uint32_t *classes;
+	uint32_t *title;
+	uint32_t *trademark;
+	uint32_t *tire_type;
+	uint32_t *tire_size;
+	/* EPREL URL stored as an interned prefix and the numeric ID */
+	uint32_t *eprel_prefix;
+	uint32_t *eprel_id;
+	struct catalogue_strings strings;
+};
+
+static uint32_t strings_hash(const char *str, size_t length) {
+	uint32_t hash = 0x811C9DC5;
+	while (length--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static const char *strings_get(const struct catalogue_strings *strings, uint32_t id,
+		size_t *length) {
+	*length = strings->offsets[id + 1] - strings->offsets[id] - 1;
+	return &strings->pool[strings->offsets[id]];
+}
+
+static int strings_rehash(struct catalogue_strings *strings, uint32_t size) {
+
+	uint32_t *slots;
+	uint32_t id;
+
+	if ((slots = calloc(size, sizeof(*slots))) == NULL)
+		return -1;
+
+	for (id = 0; id < strings->count; id++) {
+		size_t length;
+		const char *str = strings_get(strings, id, &length);
+		uint32_t i = strings_hash(str, length) & (size - 1);
+		while (slots[i] != 0)
+			i = (i + 1) & (size - 1);
+		slots[i] = id + 1;
+	}
+
+	free(strings->slots);
+	strings->slots = slots;
+	strings->slots_size = size;
+	return 0;
+}
+
+/* Get the ID of the given string. If the string is not present in the
+ * table, it is added. Upon error this function returns -1. */
+static int64_t strings_intern(struct catalogue_strings *strings, const char *str,
+		size_t length) {
+
+	const uint32_t hash = strings_hash(str, length);
+	uint32_t i, id;
+
+	if (strings->slots_size != 0)
+		for (i = hash & (strings->slots_size - 1); strings->slots[i] != 0;
+				i = (i + 1) & (strings->slots_size - 1)) {
+			size_t tmp_length;
+			const char *tmp = strings_get(strings, strings->slots[i] - 1, &tmp_length);
+			if (tmp_length == length && memcmp(tmp, str, length) == 0)
+				return strings->slots[i] - 1;
+		}
+
+	if (strings->pool_length + length + 1 > UINT32_MAX ||
+			strings->count + 1 >= UINT32_MAX / 2)
+		return -1;
+
+	if (strings->pool_length + length + 1 > strings->pool_size) {
+		size_t size = strings->pool_size == 0 ? 4096 : strings->pool_size;
+		while (strings->pool_length + length + 1 > size)
+			size *= 2;
+		char *tmp;
+		if ((tmp = realloc(strings->pool, size)) == NULL)
+			return -1;
+		strings->pool = tmp;
+		strings->pool_size = size;
+	}
+
+	if (strings->count + 2 > strings->size) {
+		uint32_t size = strings->size == 0 ? 256 : strings->size * 2;
+		uint32_t *tmp;
+		if ((tmp = realloc(strings->offsets, size * sizeof(*tmp))) == NULL)
+			return -1;
+		strings->offsets = tmp;
+		strings->size = size;
+	}
+
+	id = strings->count++;
+	strings->offsets[id] = strings->pool_length;
+	memcpy(&strings->pool[strings->pool_length], str, length);
+	strings->pool[strings->pool_length + length] = '\0';
+	strings->pool_length += length + 1;
+	strings->offsets[id + 1] = strings->pool_length;
+
+	/* keep the load factor of the hash table below 50% */
+	if (strings->count * 2 > strings->slots_size) {
+		if (strings_rehash(strings, strings->slots_size == 0 ? 512 : strings->slots_size * 2) == -1) {
+			strings->count--;
+			strings->pool_length = strings->offsets[id];
+			return -1;
+		}
+	}
+	else {
+		for (i = hash & (strings->slots_size - 1); strings->slots[i] != 0;
+				i = (i + 1) & (strings->slots_size - 1))
+			continue;
+		strings->slots[i] = id + 1;
+	}
+
+	return id;
+}
+
+struct catalogue *catalogue_new(void) {
+
+	struct catalogue *catalogue;
+
+	if ((catalogue = calloc(1, sizeof(*catalogue))) == NULL)
+		return NULL;
+
+	/* reserve the ID 0 for an empty string */
+	if (strings_intern(&catalogue->strings, "", 0) != 0) {
+		catalogue_free(catalogue);
+		return NULL;
+	}
+
+	return catalogue;
+}
+
+void catalogue_free(struct catalogue *catalogue) {
+	if (catalogue == NULL)
+		return;
+	free(catalogue->classes);
+	free(catalogue->title);
+	free(catalogue->trademark);
+	free(catalogue->tire_type);
+	free(catalogue->tire_size);
+	free(catalogue->eprel_prefix);
+	free(catalogue->eprel_id);
+	free(catalogue->strings.pool);
+	free(catalogue->strings.offsets);
+	free(catalogue->strings.slots);
+	free(catalogue);
+}
+
+static int catalogue_grow(struct catalogue *catalogue) {
+
+	uint32_t **columns[] = {
+		&catalogue->classes,
+		&catalogue->title,
+		&catalogue->trademark,
+		&catalogue->tire_type,
+		&catalogue->tire_size,
+		&catalogue->eprel_prefix,
+		&catalogue->eprel_id,
+	};
+
+	size_t size = catalogue->size == 0 ? 1024 : catalogue->size * 2;
+	size_t i;
+
+	for (i = 0; i < sizeof(columns) / sizeof(*columns); i++) {
+		uint32_t *tmp;
+		if ((tmp = realloc(*columns[i], size * sizeof(*tmp))) == NULL)
+			return -1;
+		*columns[i] = tmp;
+	}
+
+	catalogue->size = size;
+	return 0;
+}
+
+static int64_t catalogue_intern(struct catalogue *catalogue, const char *str, size_t size) {
+	return strings_intern(&catalogue->strings, str, strnlen(str, size - 1));
+}
+
+int catalogue_add(struct catalogue *catalogue, const struct eu_tire_label *data,
+		size_t *index) {
+
+	int64_t title, trademark, tire_type, tire_size, eprel_prefix;
+	uint32_t eprel_id = 0;
+
+	if (catalogue->count == catalogue->size &&
+			catalogue_grow(catalogue) == -1)
+		return -1;
+
+	/* Split EPREL URL into the prefix and the trailing numeric ID. IDs with
+	 * leading zeros are kept in the prefix, so the URL can be restored. */
+	const char *url = data->qrcode;
+	const char *end = &url[strnlen(url, sizeof(data->qrcode) - 1)];
+	const char *digits = end;
+	while (digits > url && isdigit(digits[-1]))
+		digits--;
+	if (end - digits > 0 && end - digits <= 9 && *digits != '0')
+		eprel_id = strtoul(digits, NULL, 10);
+	else
+		digits = end;
+
+	if ((title = catalogue_intern(catalogue, data->title, sizeof(data->title))) == -1 ||
+			(trademark = catalogue_intern(catalogue, data->trademark, sizeof(data->trademark))) == -1 ||
+			(tire_type = catalogue_intern(catalogue, data->tire_type, sizeof(data->tire_type))) == -1 ||
+			(tire_size = catalogue_intern(catalogue, data->tire_size, sizeof(data->tire_size))) == -1 ||
+			(eprel_prefix = strings_intern(&catalogue->strings, url, digits - url)) == -1)
+		return -1;
+
+	const size_t i = catalogue->count++;
+	catalogue->classes[i] =
+		(data->tire_class & 0x03) << PACK_TIRE_CLASS_SHIFT |
+		(data->fuel_efficiency & 0x07) << PACK_FUEL_EFFICIENCY_SHIFT |
+		(data->wet_grip & 0x07) << PACK_WET_GRIP_SHIFT |
+		(data->rolling_noise & 0x03) << PACK_ROLLING_NOISE_SHIFT |
+		(data->snow_grip ? 1 : 0) << PACK_SNOW_GRIP_SHIFT |
+		(data->ice_grip ? 1 : 0) << PACK_ICE_GRIP_SHIFT |
+		(data->rolling_noise_db & 0x7F) << PACK_ROLLING_NOISE_DB_SHIFT;
+	catalogue->title[i] = title;
+	catalogue->trademark[i] = trademark;
+	catalogue->tire_type[i] = tire_type;
+	catalogue->tire_size[i] = tire_size;
+	catalogue->eprel_prefix[i] = eprel_prefix;
+	catalogue->eprel_id[i] = eprel_id;
+
+	if (index != NULL)
+		*index = i;
+	return 0;
+}
+
+static size_t catalogue_copy(const struct catalogue *catalogue, uint32_t id,
+		char *dst, size_t size) {
+
+	size_t length;
+	const char *str = strings_get(&catalogue->strings, id, &length);
+
+	if (length > size - 1)
+		length = size - 1;
+	memcpy(dst, str, length);
+	dst[length] = '\0';
+
+	return length;
+}
+
+void catalogue_get(const struct catalogue *catalogue, size_t index,
+		struct eu_tire_label *data) {
+
+	const uint32_t classes = catalogue->classes[index];
+
+	data->tire_class = (classes >> PACK_TIRE_CLASS_SHIFT) & 0x03;
+	data->fuel_efficiency = (classes >> PACK_FUEL_EFFICIENCY_SHIFT) & 0x07;
+	data->wet_grip = (classes >> PACK_WET_GRIP_SHIFT) & 0x07;
+	data->rolling_noise = (classes >> PACK_ROLLING_NOISE_SHIFT) & 0x03;
+	data->snow_grip = (classes >> PACK_SNOW_GRIP_SHIFT) & 0x01;
+	data->ice_grip = (classes >> PACK_ICE_GRIP_SHIFT) & 0x01;
+	data->rolling_noise_db = (classes >> PACK_ROLLING_NOISE_DB_SHIFT) & 0x7F;
+
+	catalogue_copy(catalogue, catalogue->title[index], data->title, sizeof(data->title));
+	catalogue_copy(catalogue, catalogue->trademark[index], data->trademark, sizeof(data->trademark));
+	catalogue_copy(catalogue, catalogue->tire_type[index], data->tire_type, sizeof(data->tire_type));
+	catalogue_copy(catalogue, catalogue->tire_size[index], data->tire_size, sizeof(data->tire_size));
+
+	size_t length = catalogue_copy(catalogue, catalogue->eprel_prefix[index],
+			data->qrcode, sizeof(data->qrcode));
+	uint32_t id = catalogue->eprel_id[index];
+	if (id != 0) {
+		char digits[10];
+		size_t n = 0;
+		while (id != 0) {
+			digits[n++] = '0' + id % 10;
+			id /= 10;
+		}
+		while (n > 0 && length < sizeof(data->qrcode) - 1)
+			data->qrcode[length++] = digits[--n];
+		data->qrcode[length] = '\0';
+	}
+
+}
+
+bool catalogue_equal(const struct catalogue *catalogue, size_t a, size_t b) {
+	/* interned strings are equal if and only if their IDs are equal */
+	return catalogue->classes[a] == catalogue->classes[b] &&
+		catalogue->eprel_id[a] == catalogue->eprel_id[b] &&
+		catalogue->eprel_prefix[a] == catalogue->eprel_prefix[b] &&
+		catalogue->trademark[a] == catalogue->trademark[b] &&
+		catalogue->tire_type[a] == catalogue->tire_type[b] &&
+		catalogue->tire_size[a] == catalogue->tire_size[b] &&
+		catalogue->title[a] == catalogue->title[b];
+}
+
+uint32_t catalogue_hash(const struct catalogue *catalogue, size_t index) {
+	/* hash record columns, the same as they are compared in the
+	 * catalogue_equal() function */
+	const uint32_t columns[] = {
+		catalogue->classes[index],
+		catalogue->eprel_id[index],
+		catalogue->eprel_prefix[index],
+		catalogue->trademark[index],
+		catalogue->tire_type[index],
+		catalogue->tire_size[index],
+		catalogue->title[index] };
+	return strings_hash((const char *)columns, sizeof(columns));
+}
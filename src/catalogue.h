@@ -0,0 +1,39 @@
+/*
+ * EU-tire-label - catalogue.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_CATALOGUE_H_
+#define EUTIRELABEL_CATALOGUE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "label.h"
+
+struct catalogue;
+
+struct catalogue *catalogue_new(void);
+void catalogue_free(struct catalogue *catalogue);
+
+/* Add record to the catalogue. Upon success this function returns 0 and
+ * stores the index of the record in the index parameter (if not NULL). */
+int catalogue_add(struct catalogue *catalogue, const struct eu_tire_label *data,
+		size_t *index);
+
+/* Decode record into the tire label data structure. */
+void catalogue_get(const struct catalogue *catalogue, size_t index,
+		struct eu_tire_label *data);
+/* Check whether records are equal without decoding them. */
+bool catalogue_equal(const struct catalogue *catalogue, size_t a, size_t b);
+/* Get the hash of the record. Equal records have equal hashes. */
+uint32_t catalogue_hash(const struct catalogue *catalogue, size_t index);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * EU-tire-label - datauri.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "datauri.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define DATAURI_X86 1
+#endif
+
+#include "base64.h"
+#include "escape.h"
+
+/* Check whether given byte has to be percent-encoded. Apart from bytes
+ * which are not allowed in URIs, characters which would terminate the
+ * quoted HTML attribute or start the character reference are encoded,
+ * so the data URI can be pasted into the HTML document as is. */
+static bool datauri_percent_candidate(unsigned char c) {
+	if (c < 0x20 || c >= 0x7F)
+		return true;
+	switch (c) {
+	case '"': case '#': case '%': case '&': case '<': case '>':
+	case '\\': case '^': case '`': case '{': case '|': case '}':
+		return true;
+	}
+	return false;
+}
+
+/* Get the length of the leading span of the data which does not contain
+ * any byte that has to be percent-encoded. */
+static size_t datauri_percent_span_scalar(const char *data, size_t length) {
+	size_t i;
+	for (i = 0; i < length; i++)
+		if (datauri_percent_candidate(data[i]))
+			break;
+	return i;
+}
+
+#if DATAURI_X86
+__attribute__((target("sse2")))
+static inline unsigned int datauri_percent_mask_sse2(__m128i v) {
+
+	/* signed comparison: v < 0x20 or v >= 0x80 */
+	__m128i m = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('^')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('`')));
+	/* '{', '|' and '}' are adjacent: 0x7B - 0x7D */
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(
+				_mm_max_epu8(_mm_sub_epi8(v, _mm_set1_epi8('{')), _mm_set1_epi8(2)),
+				_mm_set1_epi8(2)));
+
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static size_t datauri_percent_span_sse2(const char *data, size_t length) {
+
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 16 <= length; i += 16)
+		if ((mask = datauri_percent_mask_sse2(
+						_mm_loadu_si128((const __m128i *)&data[i]))) != 0)
+			return i + __builtin_ctz(mask);
+
+	return i + datauri_percent_span_scalar(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int datauri_percent_mask_avx2(__m256i v) {
+
+	/* signed comparison: v < 0x20 or v >= 0x80 */
+	__m256i m = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v);
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('^')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('`')));
+	/* '{', '|' and '}' are adjacent: 0x7B - 0x7D */
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(
+				_mm256_max_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8('{')), _mm256_set1_epi8(2)),
+				_mm256_set1_epi8(2)));
+
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static size_t datauri_percent_span_avx2(const char *data, size_t length) {
+
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 32 <= length; i += 32)
+		if ((mask = datauri_percent_mask_avx2(
+						_mm256_loadu_si256((const __m256i *)&data[i]))) != 0)
+			return i + __builtin_ctz(mask);
+
+	return i + datauri_percent_span_sse2(&data[i], length - i);
+}
+#endif
+
+/* Span scanner selected at start-up according to the CPU features. */
+static size_t (*datauri_percent_span)(const char *data, size_t length) =
+	datauri_percent_span_scalar;
+
+__attribute__((constructor))
+static void datauri_init(void) {
+#if DATAURI_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		datauri_percent_span = datauri_percent_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		datauri_percent_span = datauri_percent_span_sse2;
+#endif
+}
+
+static size_t datauri_percent_length(const char *data, size_t length) {
+
+	size_t n = 0;
+
+	while (length > 0) {
+		size_t span = datauri_percent_span(data, length);
+		data += span;
+		length -= span;
+		n += span;
+		if (length == 0)
+			break;
+		data++;
+		length--;
+		n += 3;
+	}
+
+	return n;
+}
+
+static char *datauri_percent_copy(char *dst, const char *data, size_t length) {
+
+	static const char hex[] = "0123456789ABCDEF";
+
+	while (length > 0) {
+		size_t span = datauri_percent_span(data, length);
+		memcpy(dst, data, span);
+		data += span;
+		length -= span;
+		dst += span;
+		if (length == 0)
+			break;
+		const unsigned char c = *data++;
+		length--;
+		*dst++ = '%';
+		*dst++ = hex[c >> 4];
+		*dst++ = hex[c & 0x0F];
+	}
+
+	return dst;
+}
+
+/* Encode data scattered across many segments with base64. Bytes which do
+ * not form a complete triplet at the end of the segment are carried over
+ * to the next one, so the result is the same as for contiguous data. */
+static char *datauri_base64_copy(char *dst, const struct iovec *iov, size_t count) {
+
+	unsigned char carry[3];
+	size_t carried = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+
+		const unsigned char *data = iov[i].iov_base;
+		size_t length = iov[i].iov_len;
+
+		while (carried > 0 && carried < 3 && length > 0) {
+			carry[carried++] = *data++;
+			length--;
+		}
+		if (carried == 3) {
+			dst = base64_encode(dst, carry, carried);
+			carried = 0;
+		}
+		if (carried > 0)
+			continue;
+
+		const size_t n = length - length % 3;
+		dst = base64_encode(dst, data, n);
+		memcpy(carry, &data[n], carried = length - n);
+
+	}
+
+	return base64_encode(dst, carry, carried);
+}
+
+/* Get the length of the data URI with the given content. */
+size_t datauri_length(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding) {
+
+	size_t n = sizeof("data:,") - 1 + strlen(mime);
+	size_t length = 0;
+	size_t i;
+
+	switch (encoding) {
+	case DATAURI_PERCENT:
+		for (i = 0; i < count; i++)
+			n += datauri_percent_length(iov[i].iov_base, iov[i].iov_len);
+		break;
+	case DATAURI_BASE64:
+		for (i = 0; i < count; i++)
+			length += iov[i].iov_len;
+		n += sizeof(";base64") - 1 + BASE64_LENGTH(length);
+		break;
+	}
+
+	return n;
+}
+
+/* Write the data URI with the given content. The destination buffer shall
+ * be at least datauri_length() bytes long. Returned value points to the end
+ * of the written data. Note, that the output is not null-terminated. */
+char *datauri_copy(char *dst, const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding) {
+
+	const size_t mime_len = strlen(mime);
+	size_t i;
+
+	memcpy(dst, "data:", 5);
+	memcpy(dst += 5, mime, mime_len);
+	dst += mime_len;
+
+	switch (encoding) {
+	case DATAURI_PERCENT:
+		*dst++ = ',';
+		for (i = 0; i < count; i++)
+			dst = datauri_percent_copy(dst, iov[i].iov_base, iov[i].iov_len);
+		break;
+	case DATAURI_BASE64:
+		memcpy(dst, ";base64,", 8);
+		dst = datauri_base64_copy(dst + 8, iov, count);
+		break;
+	}
+
+	return dst;
+}
+
+/* Create the data URI with the given content. Memory for the new string is
+ * obtained with malloc(3), and can be freed with free(3). */
+char *datauri_dup(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding, size_t *length) {
+
+	char *uri;
+
+	if ((uri = malloc(datauri_length(mime, iov, count, encoding) + 1)) == NULL)
+		return NULL;
+
+	char *end = datauri_copy(uri, mime, iov, count, encoding);
+	*length = end - uri;
+	*end = '\0';
+
+	return uri;
+}
+
+/* Create the HTML image element with the given content embedded as a data
+ * URI. Width and height attributes are added only if they are positive.
+ * Memory for the new string is obtained with malloc(3), and can be freed
+ * with free(3). */
+char *datauri_img_dup(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding, const char *alt, int width, int height,
+		size_t *length) {
+
+	const size_t alt_len = strlen(alt);
+	char dimensions[48] = "";
+	char *img, *p;
+	int n = 0;
+
+	if (width > 0)
+		n += snprintf(&dimensions[n], sizeof(dimensions) - n, " width=\"%d\"", width);
+	if (height > 0)
+		snprintf(&dimensions[n], sizeof(dimensions) - n, " height=\"%d\"", height);
+
+	const size_t dimensions_len = strlen(dimensions);
+	if ((img = malloc(sizeof("<img src=\"\" alt=\"\">") +
+					datauri_length(mime, iov, count, encoding) + dimensions_len +
+					escape_length(alt, alt_len, ESCAPE_ATTR))) == NULL)
+		return NULL;
+
+	memcpy(img, "<img src=\"", 10);
+	p = datauri_copy(img + 10, mime, iov, count, encoding);
+	*p++ = '"';
+	memcpy(p, dimensions, dimensions_len);
+	p += dimensions_len;
+	memcpy(p, " alt=\"", 6);
+	p = escape_copy(p + 6, alt, alt_len, ESCAPE_ATTR);
+	memcpy(p, "\">", 2);
+	p += 2;
+
+	*length = p - img;
+	*p = '\0';
+
+	return img;
+}
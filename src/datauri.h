@@ -0,0 +1,36 @@
+/*
+ * EU-tire-label - datauri.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_DATAURI_H_
+#define EUTIRELABEL_DATAURI_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+enum datauri_encoding {
+	/* minimal percent-encoding, suitable for text formats (e.g. SVG) */
+	DATAURI_PERCENT = 0,
+	/* base64 encoding, suitable for binary formats */
+	DATAURI_BASE64,
+};
+
+size_t datauri_length(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding);
+char *datauri_copy(char *dst, const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding);
+
+char *datauri_dup(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding, size_t *length);
+char *datauri_img_dup(const char *mime, const struct iovec *iov, size_t count,
+		enum datauri_encoding encoding, const char *alt, int width, int height,
+		size_t *length);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * EU-tire-label - escape.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "escape.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define ESCAPE_X86 1
+#endif
+
+/* Check whether given byte might require escaping in the given context.
+ * Note, that this function returns true also for white space control
+ * characters, which are allowed in the text and CDATA contexts. */
+static bool escape_candidate(unsigned char c, enum escape_context ctx) {
+	if (c < 0x20)
+		return true;
+	switch (ctx) {
+	case ESCAPE_ATTR:
+		if (c == '"' || c == '\'')
+			return true;
+		/* fall-through */
+	case ESCAPE_TEXT:
+		return c == '&' || c == '<' || c == '>';
+	case ESCAPE_CDATA:
+		return c == ']';
+	}
+	return false;
+}
+
+/* Get the length of the leading span of the text which does not contain
+ * any byte that might require escaping. */
+static size_t escape_span_scalar(const char *text, size_t length, enum escape_context ctx) {
+	size_t i;
+	for (i = 0; i < length; i++)
+		if (escape_candidate(text[i], ctx))
+			break;
+	return i;
+}
+
+#if ESCAPE_X86
+__attribute__((target("sse2")))
+static inline unsigned int escape_candidate_mask_sse2(__m128i v, enum escape_context ctx) {
+
+	const __m128i ctrl = _mm_set1_epi8(0x1F);
+	/* unsigned comparison: v <= 0x1F */
+	__m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl);
+
+	switch (ctx) {
+	case ESCAPE_ATTR:
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		/* fall-through */
+	case ESCAPE_TEXT:
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+		break;
+	case ESCAPE_CDATA:
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+		break;
+	}
+
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static size_t escape_span_sse2(const char *text, size_t length, enum escape_context ctx) {
+
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 16 <= length; i += 16)
+		if ((mask = escape_candidate_mask_sse2(
+						_mm_loadu_si128((const __m128i *)&text[i]), ctx)) != 0)
+			return i + __builtin_ctz(mask);
+
+	return i + escape_span_scalar(&text[i], length - i, ctx);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int escape_candidate_mask_avx2(__m256i v, enum escape_context ctx) {
+
+	const __m256i ctrl = _mm256_set1_epi8(0x1F);
+	/* unsigned comparison: v <= 0x1F */
+	__m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl);
+
+	switch (ctx) {
+	case ESCAPE_ATTR:
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+		/* fall-through */
+	case ESCAPE_TEXT:
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+		break;
+	case ESCAPE_CDATA:
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+		break;
+	}
+
+	return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static size_t escape_span_avx2(const char *text, size_t length, enum escape_context ctx) {
+
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 32 <= length; i += 32)
+		if ((mask = escape_candidate_mask_avx2(
+						_mm256_loadu_si256((const __m256i *)&text[i]), ctx)) != 0)
+			return i + __builtin_ctz(mask);
+
+	return i + escape_span_sse2(&text[i], length - i, ctx);
+}
+#endif
+
+/* Span scanner selected at start-up according to the CPU features, so the
+ * default (baseline ISA) build uses the widest available vector unit. */
+static size_t (*escape_span)(const char *text, size_t length,
+		enum escape_context ctx) = escape_span_scalar;
+
+__attribute__((constructor))
+static void escape_init(void) {
+#if ESCAPE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		escape_span = escape_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		escape_span = escape_span_sse2;
+#endif
+}
+
+/* Get the replacement for the escape candidate at the beginning of the
+ * text. The number of consumed input bytes is stored in the consumed
+ * variable. Control characters not allowed in XML are dropped. */
+static const char *escape_replacement(const char *text, size_t length,
+		enum escape_context ctx, size_t *consumed, size_t *replacement_len) {
+
+	static const char *entities[] = {
+		['\t'] = "&#9;", ['\n'] = "&#10;", ['\r'] = "&#13;",
+		['"'] = "&quot;", ['&'] = "&amp;", ['\''] = "&apos;",
+		['<'] = "&lt;", ['>'] = "&gt;",
+	};
+
+	const unsigned char c = text[0];
+	*consumed = 1;
+
+	if (c < 0x20 && c != '\t' && c != '\n' && c != '\r') {
+		*replacement_len = 0;
+		return "";
+	}
+
+	switch (ctx) {
+	case ESCAPE_TEXT:
+		if (c < 0x20)
+			break;
+		/* fall-through */
+	case ESCAPE_ATTR:
+		*replacement_len = strlen(entities[c]);
+		return entities[c];
+	case ESCAPE_CDATA:
+		/* split CDATA section in the middle of the end sequence */
+		if (c == ']' && length >= 3 && text[1] == ']' && text[2] == '>') {
+			*consumed = 3;
+			*replacement_len = sizeof("]]]]><![CDATA[>") - 1;
+			return "]]]]><![CDATA[>";
+		}
+		break;
+	}
+
+	*replacement_len = 1;
+	return text;
+}
+
+/* Get the length of the text after escaping. */
+size_t escape_length(const char *text, size_t length, enum escape_context ctx) {
+
+	size_t n = 0;
+
+	while (length > 0) {
+
+		size_t span = escape_span(text, length, ctx);
+		text += span;
+		length -= span;
+		n += span;
+
+		if (length == 0)
+			break;
+
+		size_t consumed, replacement_len;
+		escape_replacement(text, length, ctx, &consumed, &replacement_len);
+		text += consumed;
+		length -= consumed;
+		n += replacement_len;
+
+	}
+
+	return n;
+}
+
+/* Escape text for the given context. The destination buffer shall be
+ * at least escape_length() bytes long. Returned value points to the end
+ * of the written data. Note, that the output is not null-terminated. */
+char *escape_copy(char *dst, const char *text, size_t length, enum escape_context ctx) {
+
+	while (length > 0) {
+
+		size_t span = escape_span(text, length, ctx);
+		memcpy(dst, text, span);
+		text += span;
+		length -= span;
+		dst += span;
+
+		if (length == 0)
+			break;
+
+		size_t consumed, replacement_len;
+		const char *replacement = escape_replacement(text, length, ctx,
+				&consumed, &replacement_len);
+		memcpy(dst, replacement, replacement_len);
+		text += consumed;
+		length -= consumed;
+		dst += replacement_len;
+
+	}
+
+	return dst;
+}
+
+/* Escape text for the given context. Memory for the new string is obtained
+ * with malloc(3), and can be freed with free(3). */
+char *escape_dup(const char *text, enum escape_context ctx) {
+
+	size_t length = strlen(text);
+	char *escaped;
+
+	if ((escaped = malloc(escape_length(text, length, ctx) + 1)) == NULL)
+		return NULL;
+
+	*escape_copy(escaped, text, length, ctx) = '\0';
+	return escaped;
+}
@@ -0,0 +1,30 @@
+/*
+ * EU-tire-label - escape.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_ESCAPE_H_
+#define EUTIRELABEL_ESCAPE_H_
+
+#include <stddef.h>
+
+enum escape_context {
+	/* XML character data */
+	ESCAPE_TEXT = 0,
+	/* content of the CDATA section */
+	ESCAPE_CDATA,
+	/* quoted XML attribute value */
+	ESCAPE_ATTR,
+};
+
+size_t escape_length(const char *text, size_t length, enum escape_context ctx);
+char *escape_copy(char *dst, const char *text, size_t length, enum escape_context ctx);
+char *escape_dup(const char *text, enum escape_context ctx);
+
+#endif
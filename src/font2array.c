@@ -0,0 +1,121 @@
+/*
+ * EU-tire-label - font2array.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+/* Glyph coordinates are normalized to this number of units per EM. */
+#define UNITS_PER_EM 1000
+
+static double scale = 1.0;
+
+static void print_point(char command, const FT_Vector *point) {
+	if (command)
+		printf("%c", command);
+	else
+		printf(" ");
+	printf("%ld %ld", lround(point->x * scale), lround(-point->y * scale));
+}
+
+static int move_to(const FT_Vector *to, void *user) {
+	int *contours = user;
+	if ((*contours)++ > 0)
+		printf("Z");
+	print_point('M', to);
+	return 0;
+}
+
+static int line_to(const FT_Vector *to, void *user) {
+	(void)user;
+	print_point('L', to);
+	return 0;
+}
+
+static int conic_to(const FT_Vector *control, const FT_Vector *to, void *user) {
+	(void)user;
+	print_point('Q', control);
+	print_point(0, to);
+	return 0;
+}
+
+static int cubic_to(const FT_Vector *control1, const FT_Vector *control2,
+		const FT_Vector *to, void *user) {
+	(void)user;
+	print_point('C', control1);
+	print_point(0, control2);
+	print_point(0, to);
+	return 0;
+}
+
+/* Dump outlines of printable ASCII and Latin-1 Supplement characters. Note,
+ * that the order of glyphs shall match the one used in the outline.c file. */
+int font2array(const char *variable, const char *filename) {
+
+	static const FT_Outline_Funcs funcs = {
+		.move_to = move_to,
+		.line_to = line_to,
+		.conic_to = conic_to,
+		.cubic_to = cubic_to,
+	};
+
+	FT_Library library;
+	FT_Face face;
+	unsigned long c;
+
+	if (FT_Init_FreeType(&library) != 0)
+		return -1;
+	if (FT_New_Face(library, filename, 0, &face) != 0)
+		return -1;
+
+	scale = (double)UNITS_PER_EM / face->units_per_EM;
+
+	printf("const struct outline_glyph %s[] = {\n", variable);
+
+	for (c = 0x20; c <= 0xFF; c++) {
+
+		int contours = 0;
+
+		if (c > 0x7E && c < 0xA0)
+			continue;
+
+		if (FT_Load_Char(face, c, FT_LOAD_NO_SCALE) != 0)
+			return -1;
+
+		printf("\t{ %ld, \"", lround(face->glyph->advance.x * scale));
+		FT_Outline_Decompose(&face->glyph->outline, &funcs, &contours);
+		printf("%s\" },\n", contours ? "Z" : "");
+
+	}
+
+	printf("};\n");
+
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <var> <font>\n", argv[0]);
+		return 1;
+	}
+
+	if (font2array(argv[1], argv[2]) == -1) {
+		fprintf(stderr, "font2array: Couldn't load font outlines: %s\n", argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
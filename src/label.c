@@ -9,6 +9,7 @@
  */
 
 #include "label.h"
+#include "escape.h"
 
 #include <ctype.h>
 #include <stdio.h>
@@ -22,49 +23,123 @@
 #include "label_EC_1222_2009-template.h"
 #include "label_EU_2020_740-template.h"
 
-/**
- * Replace every occurrence of src in the data with dst. Memory for the new
- * string is obtained with malloc(3), and can be freed with free(3). */
-static char *strrep(const char *data, const char *src, const char *dst) {
+/* Placeholder within the label template, e.g. [TIRE-CLASS], and the text
+ * which shall be put in its place. */
+struct label_field {
+	const char *name;
+	const char *value;
+};
+
+static int label_iov_append(struct label_iov *label, const char *data, size_t length) {
+
+	if (length == 0)
+		return 0;
+
+	if (label->count == label->size) {
+		size_t size = label->size == 0 ? 64 : label->size * 2;
+		struct iovec *tmp;
+		if ((tmp = realloc(label->iov, size * sizeof(*tmp))) == NULL)
+			return -1;
+		label->iov = tmp;
+		label->size = size;
+	}
 
-	char *newdata = strdup(data);
-	char *tok = NULL;
+	label->iov[label->count].iov_base = (void *)data;
+	label->iov[label->count].iov_len = length;
+	label->length += length;
+	label->count++;
+	return 0;
+}
 
-	size_t srclen = strlen(src);
-	size_t dstlen = strlen(dst);
-	size_t len = 0;
+/* Take the ownership of the string allocated with malloc(3). The string
+ * is released with the label_iov_free() call. */
+static const char *label_iov_own(struct label_iov *label, char *str) {
 
-	while ((tok = strstr(&newdata[len], src)) != NULL) {
+	if (str == NULL)
+		return NULL;
 
-		int newdatalen = strlen(newdata);
-		len += tok - &newdata[len];
+	if (label->strings_count == sizeof(label->strings) / sizeof(*label->strings)) {
+		free(str);
+		return NULL;
+	}
 
-		if (srclen < dstlen) {
-			char *tmp;
-			if ((tmp = realloc(newdata, newdatalen - srclen + dstlen + 1)) == NULL) {
-				free(newdata);
-				return NULL;
-			}
-			newdata = tmp;
-		}
+	label->strings[label->strings_count++] = str;
+	return str;
+}
+
+static const char *label_iov_escape(struct label_iov *label, const char *text,
+		enum escape_context ctx) {
+	return label_iov_own(label, escape_dup(text, ctx));
+}
 
-		memmove(&newdata[len + dstlen], &newdata[len + srclen], newdatalen - len - srclen + 1);
-		memcpy(&newdata[len], dst, dstlen);
+static const struct label_field *label_field_lookup(const struct label_field *fields,
+		size_t count, const char *name, size_t length) {
+	size_t i;
+	for (i = 0; i < count; i++)
+		if (strncmp(fields[i].name, name, length) == 0 &&
+				fields[i].name[length] == '\0')
+			return &fields[i];
+	return NULL;
+}
+
+/**
+ * Split the template into static segments and field values. Static segments
+ * point directly into the read-only template, so the template is neither
+ * copied nor modified. Unknown placeholders are left intact. */
+static int label_iov_build(struct label_iov *label, const char *template,
+		size_t template_length, const struct label_field *fields, size_t count) {
+
+	const char *end = &template[template_length];
+	const char *segment = template;
+	const char *p = template;
+
+	while ((p = memchr(p, '[', end - p)) != NULL) {
+
+		const char *name = ++p;
+		while (p < end && (isupper(*p) || isdigit(*p) || *p == '-'))
+			p++;
+
+		const struct label_field *field;
+		if (p == end || *p != ']' ||
+				(field = label_field_lookup(fields, count, name, p - name)) == NULL)
+			continue;
+		if (field->value == NULL)
+			return -1;
+
+		if (label_iov_append(label, segment, name - 1 - segment) == -1 ||
+				label_iov_append(label, field->value, strlen(field->value)) == -1)
+			return -1;
+		segment = ++p;
 
-		len += dstlen;
 	}
 
-	return newdata;
+	return label_iov_append(label, segment, end - segment);
 }
 
-/**
- * Helper function related to the strrep which frees passed source memory.
- * Note, that the passed source string HAS TO be allocated with malloc(3)
- * functions family. */
-static char *strrep_x(char *data, const char *src, const char *dst) {
-	char *tmp = strrep(data, src, dst);
-	free(data);
-	return tmp;
+char *label_iov_join(const struct label_iov *label) {
+
+	char *str, *p;
+	size_t i;
+
+	if ((str = p = malloc(label->length + 1)) == NULL)
+		return NULL;
+
+	for (i = 0; i < label->count; i++) {
+		memcpy(p, label->iov[i].iov_base, label->iov[i].iov_len);
+		p += label->iov[i].iov_len;
+	}
+
+	*p = '\0';
+	return str;
+}
+
+void label_iov_free(struct label_iov *label) {
+	while (label->strings_count > 0)
+		free(label->strings[--label->strings_count]);
+	free(label->iov);
+	label->iov = NULL;
+	label->count = label->size = 0;
+	label->length = 0;
 }
 
 /**
@@ -149,52 +224,48 @@ fail:
 	return encoded;
 }
 
-char *create_label_EC_1222_2009(const struct eu_tire_label *data) {
+int create_label_iov_EC_1222_2009(const struct eu_tire_label *data,
+		struct label_iov *label) {
 
 	static const char *classes[] = { "", "C1", "C2", "C3" };
 	static const char *display[] = { "none", "", "", "", "", "", "", "" };
 	static const char *letters[] = { "", "A", "B", "C", "D", "E", "F", "G" };
 	static const char *y[] = { "0", "24.375", "29.875", "35.375", "40.875", "46.375", "51.875", "58.375" };
 	char db[16] = "";
-	char *label;
-
-	label = strrep(label_EC_1222_2009_template, "[TITLE]", data->title);
-
-	label = strrep_x(label, "[TIRE-CLASS]", classes[data->tire_class]);
-
-	label = strrep_x(label, "[FUEL-EFFICIENCY-DISPLAY]", display[data->fuel_efficiency]);
-	label = strrep_x(label, "[FUEL-EFFICIENCY-Y]", y[data->fuel_efficiency]);
-	label = strrep_x(label, "[FUEL-EFFICIENCY]", letters[data->fuel_efficiency]);
-
-	label = strrep_x(label, "[WET-GRIP-DISPLAY]", display[data->wet_grip]);
-	label = strrep_x(label, "[WET-GRIP-Y]", y[data->wet_grip]);
-	label = strrep_x(label, "[WET-GRIP]", letters[data->wet_grip]);
-
-	switch (data->rolling_noise) {
-	case RNC_3:
-		label = strrep_x(label, "[ROLLING-NOISE-3-DISPLAY]", "none");
-		/* fall-through */
-	case RNC_2:
-		label = strrep_x(label, "[ROLLING-NOISE-2-DISPLAY]", "none");
-		/* fall-through */
-	case RNC_1:
-		label = strrep_x(label, "[ROLLING-NOISE-1-DISPLAY]", "none");
-		/* fall-through */
-	case RNC_NONE:
-		label = strrep_x(label, "[ROLLING-NOISE-1-DISPLAY]", "");
-		label = strrep_x(label, "[ROLLING-NOISE-2-DISPLAY]", "");
-		label = strrep_x(label, "[ROLLING-NOISE-3-DISPLAY]", "");
-	}
+
+	memset(label, 0, sizeof(*label));
 
 	if (data->rolling_noise_db)
 		sprintf(db, "%d", data->rolling_noise_db);
-	label = strrep_x(label, "[ROLLING-NOISE-DB-DISPLAY]", data->rolling_noise_db ? "" : "none");
-	label = strrep_x(label, "[ROLLING-NOISE-DB]", db);
 
-	return label;
+	const struct label_field fields[] = {
+		{ "TITLE", label_iov_escape(label, data->title, ESCAPE_CDATA) },
+		{ "TIRE-CLASS", classes[data->tire_class] },
+		{ "FUEL-EFFICIENCY-DISPLAY", display[data->fuel_efficiency] },
+		{ "FUEL-EFFICIENCY-Y", y[data->fuel_efficiency] },
+		{ "FUEL-EFFICIENCY", letters[data->fuel_efficiency] },
+		{ "WET-GRIP-DISPLAY", display[data->wet_grip] },
+		{ "WET-GRIP-Y", y[data->wet_grip] },
+		{ "WET-GRIP", letters[data->wet_grip] },
+		{ "ROLLING-NOISE-1-DISPLAY", data->rolling_noise >= RNC_1 ? "none" : "" },
+		{ "ROLLING-NOISE-2-DISPLAY", data->rolling_noise >= RNC_2 ? "none" : "" },
+		{ "ROLLING-NOISE-3-DISPLAY", data->rolling_noise >= RNC_3 ? "none" : "" },
+		{ "ROLLING-NOISE-DB-DISPLAY", data->rolling_noise_db ? "" : "none" },
+		{ "ROLLING-NOISE-DB", label_iov_own(label, strdup(db)) },
+	};
+
+	if (label_iov_build(label, label_EC_1222_2009_template,
+				sizeof(label_EC_1222_2009_template) - 1,
+				fields, sizeof(fields) / sizeof(*fields)) == -1) {
+		label_iov_free(label);
+		return -1;
+	}
+
+	return 0;
 }
 
-char *create_label_EU_2020_740(const struct eu_tire_label *data) {
+int create_label_iov_EU_2020_740(const struct eu_tire_label *data,
+		struct label_iov *label) {
 
 	static const char *classes[] = { "", "C1", "C2", "C3" };
 	static const char *display[] = { "none", "", "", "", "", "", "", "" };
@@ -212,30 +283,8 @@ char *create_label_EU_2020_740(const struct eu_tire_label *data) {
 	unsigned int x = 0;
 	char db[16] = "";
 	char *qrcode_url;
-	char *qrcode;
-	char *label;
 
-	label = strrep(label_EU_2020_740_template, "[TITLE]", data->title);
-
-	qrcode_url = urlencode(data->qrcode);
-	qrcode = create_qrcode(3 /* 29 x 29 */, data->qrcode);
-	label = strrep_x(label, "[QR-CODE-HREF]", qrcode_url);
-	label = strrep_x(label, "[QR-CODE]", qrcode);
-	free(qrcode_url);
-	free(qrcode);
-
-	label = strrep_x(label, "[TRADEMARK]", data->trademark);
-	label = strrep_x(label, "[TIRE-TYPE]", data->tire_type);
-	label = strrep_x(label, "[TIRE-SIZE-DESIGNATION]", data->tire_size);
-	label = strrep_x(label, "[TIRE-CLASS]", classes[data->tire_class]);
-
-	label = strrep_x(label, "[FUEL-EFFICIENCY-DISPLAY]", display[data->fuel_efficiency]);
-	label = strrep_x(label, "[FUEL-EFFICIENCY-Y]", y[data->fuel_efficiency]);
-	label = strrep_x(label, "[FUEL-EFFICIENCY]", letters[data->fuel_efficiency]);
-
-	label = strrep_x(label, "[WET-GRIP-DISPLAY]", display[data->wet_grip]);
-	label = strrep_x(label, "[WET-GRIP-Y]", y[data->wet_grip]);
-	label = strrep_x(label, "[WET-GRIP]", letters[data->wet_grip]);
+	memset(label, 0, sizeof(*label));
 
 	if (data->rolling_noise != RNC_NONE || data->rolling_noise_db)
 		x |= 1 << 0;
@@ -247,34 +296,97 @@ char *create_label_EU_2020_740(const struct eu_tire_label *data) {
 	if (data->rolling_noise_db)
 		sprintf(db, "%d", data->rolling_noise_db);
 
-	label = strrep_x(label, "[ROLLING-NOISE-DISPLAY]", data->rolling_noise_db ? "" : "none");
-	label = strrep_x(label, "[ROLLING-NOISE-X]", footer[x][0]);
-	label = strrep_x(label, "[ROLLING-NOISE-DB]", db);
-
-	switch (data->rolling_noise) {
-	case RNC_1:
-		label = strrep_x(label, "[ROLLING-NOISE-A]", "active");
-		goto case_rnc_none;
-	case RNC_2:
-		label = strrep_x(label, "[ROLLING-NOISE-B]", "active");
-		goto case_rnc_none;
-	case RNC_3:
-		label = strrep_x(label, "[ROLLING-NOISE-C]", "active");
-		goto case_rnc_none;
-	case RNC_NONE:
-	case_rnc_none:
-		label = strrep_x(label, "[ROLLING-NOISE-A]", "");
-		label = strrep_x(label, "[ROLLING-NOISE-B]", "");
-		label = strrep_x(label, "[ROLLING-NOISE-C]", "");
+	const char *qrcode_href = NULL;
+	if ((qrcode_url = urlencode(data->qrcode)) != NULL) {
+		qrcode_href = label_iov_escape(label, qrcode_url, ESCAPE_ATTR);
+		free(qrcode_url);
 	}
 
-	label = strrep_x(label, "[SNOW-GRIP-DISPLAY]", data->snow_grip ? "" : "none");
-	label = strrep_x(label, "[SNOW-GRIP-X]", footer[x][1]);
+	const struct label_field fields[] = {
+		{ "TITLE", label_iov_escape(label, data->title, ESCAPE_CDATA) },
+		{ "QR-CODE-HREF", qrcode_href },
+		{ "QR-CODE", label_iov_own(label, create_qrcode(3 /* 29 x 29 */, data->qrcode)) },
+		{ "TRADEMARK", label_iov_escape(label, data->trademark, ESCAPE_CDATA) },
+		{ "TIRE-TYPE", label_iov_escape(label, data->tire_type, ESCAPE_CDATA) },
+		{ "TIRE-SIZE-DESIGNATION", label_iov_escape(label, data->tire_size, ESCAPE_CDATA) },
+		{ "TIRE-CLASS", classes[data->tire_class] },
+		{ "FUEL-EFFICIENCY-DISPLAY", display[data->fuel_efficiency] },
+		{ "FUEL-EFFICIENCY-Y", y[data->fuel_efficiency] },
+		{ "FUEL-EFFICIENCY", letters[data->fuel_efficiency] },
+		{ "WET-GRIP-DISPLAY", display[data->wet_grip] },
+		{ "WET-GRIP-Y", y[data->wet_grip] },
+		{ "WET-GRIP", letters[data->wet_grip] },
+		{ "ROLLING-NOISE-DISPLAY", data->rolling_noise_db ? "" : "none" },
+		{ "ROLLING-NOISE-X", footer[x][0] },
+		{ "ROLLING-NOISE-DB", label_iov_own(label, strdup(db)) },
+		{ "ROLLING-NOISE-A", data->rolling_noise == RNC_1 ? "active" : "" },
+		{ "ROLLING-NOISE-B", data->rolling_noise == RNC_2 ? "active" : "" },
+		{ "ROLLING-NOISE-C", data->rolling_noise == RNC_3 ? "active" : "" },
+		{ "SNOW-GRIP-DISPLAY", data->snow_grip ? "" : "none" },
+		{ "SNOW-GRIP-X", footer[x][1] },
+		{ "ICE-GRIP-DISPLAY", data->ice_grip ? "" : "none" },
+		{ "ICE-GRIP-X", footer[x][2] },
+	};
+
+	if (label_iov_build(label, label_EU_2020_740_template,
+				sizeof(label_EU_2020_740_template) - 1,
+				fields, sizeof(fields) / sizeof(*fields)) == -1) {
+		label_iov_free(label);
+		return -1;
+	}
+
+	return 0;
+}
+
+char *create_label_EC_1222_2009(const struct eu_tire_label *data) {
+
+	struct label_iov label;
+	char *str;
 
-	label = strrep_x(label, "[ICE-GRIP-DISPLAY]", data->ice_grip ? "" : "none");
-	label = strrep_x(label, "[ICE-GRIP-X]", footer[x][2]);
+	if (create_label_iov_EC_1222_2009(data, &label) == -1)
+		return NULL;
 
-	return label;
+	str = label_iov_join(&label);
+	label_iov_free(&label);
+	return str;
+}
+
+char *create_label_EU_2020_740(const struct eu_tire_label *data) {
+
+	struct label_iov label;
+	char *str;
+
+	if (create_label_iov_EU_2020_740(data, &label) == -1)
+		return NULL;
+
+	str = label_iov_join(&label);
+	label_iov_free(&label);
+	return str;
+}
+
+/* Get the identity of label templates compiled into this binary. It is the
+ * FNV-1a hash of both templates, computed once per process. */
+uint64_t label_template_id(void) {
+
+	static uint64_t id = 0;
+	const char *templates[] = {
+		label_EC_1222_2009_template, label_EU_2020_740_template };
+	const size_t lengths[] = {
+		sizeof(label_EC_1222_2009_template) - 1,
+		sizeof(label_EU_2020_740_template) - 1 };
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	size_t i, j;
+
+	if (id != 0)
+		return id;
+
+	for (i = 0; i < sizeof(templates) / sizeof(*templates); i++)
+		for (j = 0; j < lengths[i]; j++) {
+			hash ^= (unsigned char)templates[i][j];
+			hash *= 0x100000001B3ULL;
+		}
+
+	return id = hash;
 }
 
 enum tire_class parse_tire_class(const char *str) {
@@ -355,16 +467,3 @@ unsigned int parse_rolling_noise_db(const char *str) {
 	fprintf(stderr, "warning: invalid rolling noise dB value: %s\n", str);
 	return 0;
 }
-
-unsigned int sanitize_plain_text(char *text) {
-
-	unsigned int rv = 0;
-	char *tmp;
-
-	while ((tmp = strstr(text, "]]>")) != NULL) {
-		tmp[1] = '|';
-		rv = 1;
-	}
-
-	return rv;
-}
@@ -12,6 +12,10 @@
 #ifndef EUTIRELABEL_LABEL_H_
 #define EUTIRELABEL_LABEL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 enum tire_class {
 	TC_ERROR = 0,
 	TC_C1,
@@ -48,6 +52,11 @@ enum rolling_noise_class {
 	RNC_3,
 };
 
+/* Physical dimensions of the label in millimetres, which are also used as
+ * the SVG view-box of both label templates. */
+#define LABEL_WIDTH_MM 75
+#define LABEL_HEIGHT_MM 110
+
 struct eu_tire_label {
 	char title[128];
 	char qrcode[64];
@@ -63,17 +72,45 @@ struct eu_tire_label {
 	unsigned int ice_grip;
 };
 
+/* EU tire label in the SVG format described as a list of segments, which
+ * can be written with a single writev(2) call. Static segments point into
+ * the read-only label template. */
+struct label_iov {
+	struct iovec *iov;
+	size_t count;
+	size_t size;
+	/* total length of all segments */
+	size_t length;
+	/* memory for dynamic segments */
+	char *strings[8];
+	size_t strings_count;
+};
+
 /* Create EU tire label in the SVG format according to the given tire label
  * data structure. Memory for the string is obtained with malloc(3), and can
  * be freed with free(3). */
 char *create_label_EC_1222_2009(const struct eu_tire_label *data);
 char *create_label_EU_2020_740(const struct eu_tire_label *data);
 
+/* Create EU tire label as a list of segments. Upon success this function
+ * returns 0, and the label shall be released with label_iov_free(). */
+int create_label_iov_EC_1222_2009(const struct eu_tire_label *data,
+		struct label_iov *label);
+int create_label_iov_EU_2020_740(const struct eu_tire_label *data,
+		struct label_iov *label);
+
+/* Join label segments into a string. Memory for the string is obtained with
+ * malloc(3), and can be freed with free(3). */
+char *label_iov_join(const struct label_iov *label);
+void label_iov_free(struct label_iov *label);
+
+/* Get the identity of label templates compiled into this binary. */
+uint64_t label_template_id(void);
+
 enum tire_class parse_tire_class(const char *str);
 enum fuel_efficiency_class parse_fuel_efficiency_class(const char *str);
 enum wet_grip_class parse_wet_grip_class(const char *str);
 enum rolling_noise_class parse_rolling_noise_class(const char *str);
 unsigned int parse_rolling_noise_db(const char *str);
-unsigned int sanitize_plain_text(char *text);
 
 #endif
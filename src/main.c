@@ -10,22 +10,74 @@
 
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "datauri.h"
 #include "label.h"
+#include "output.h"
+#if ENABLE_CGI
+# include "batch.h"
+#endif
+#if ENABLE_CACHE
+# include "cache.h"
+#endif
 #if ENABLE_PNG
-# include "raster.h"
+# include "admission.h"
+# include "module.h"
 #endif
 
 enum output_format {
 	FORMAT_SVG = 0,
 	FORMAT_PNG,
+	FORMAT_WEBP,
+	/* complete label for thermal printers */
+	FORMAT_ZPL,
+	/* label difference against the background stored in the printer */
+	FORMAT_ZPL_OVERLAY,
+	/* command which stores the label background in the printer */
+	FORMAT_ZPL_GRAPHIC,
+};
+
+enum zpl_background {
+	ZPL_BACKGROUND_NONE = 0,
+	ZPL_BACKGROUND_RECALL,
+	ZPL_BACKGROUND_STORE,
+};
+
+enum output_embedding {
+	EMBED_NONE = 0,
+	/* label as a data URI */
+	EMBED_DATAURI,
+	/* label as an HTML image element with a data URI */
+	EMBED_HTML,
 };
 
+/* Get the MIME type of the given output format. */
+static const char *get_content_type(enum output_format format) {
+	switch (format) {
+	case FORMAT_PNG:
+		return "image/png";
+	case FORMAT_WEBP:
+		return "image/webp";
+	case FORMAT_ZPL:
+	case FORMAT_ZPL_OVERLAY:
+	case FORMAT_ZPL_GRAPHIC:
+		return "text/plain";
+	case FORMAT_SVG:
+	default:
+		return "image/svg+xml";
+	}
+}
+
 /* Parse label dimensions according to the WIDTH[xHEIGHT] format. If parsing
  * fails passed variables are not modified. */
 void parse_label_dimensions(const char *str, int *width, int *height) {
@@ -57,6 +109,16 @@ void parse_label_dimensions(const char *str, int *width, int *height) {
 	free(tmp);
 }
 
+#if ENABLE_PNG
+static enum zpl_background parse_zpl_background(const char *str) {
+	if (strcasecmp(str, "recall") == 0)
+		return ZPL_BACKGROUND_RECALL;
+	if (strcasecmp(str, "store") == 0)
+		return ZPL_BACKGROUND_STORE;
+	return ZPL_BACKGROUND_NONE;
+}
+#endif
+
 /* Decode URL-encoded string. Memory for decoded string is allocated with
  * malloc(3), and shall be freed with free(3). */
 static char *urldecode(const char *str) {
@@ -91,6 +153,311 @@ static char *urldecode(const char *str) {
 	return decoded;
 }
 
+#if ENABLE_CGI
+/* Check whether the media type is explicitly accepted by the client according
+ * to the HTTP Accept header. Media ranges with the zero quality value (q=0)
+ * are not acceptable. */
+static bool http_accepts(const char *accept, const char *type) {
+
+	const size_t length = strlen(type);
+
+	while (*(accept += strspn(accept, " \t,")) != '\0') {
+
+		const char *end = accept + strcspn(accept, ",");
+		const char *p = accept + strcspn(accept, ";, \t");
+
+		if ((size_t)(p - accept) == length && strncasecmp(accept, type, length) == 0) {
+			double q = 1;
+			for (; p < end; p++)
+				if (*p == ';') {
+					const char *param = p + 1 + strspn(p + 1, " \t");
+					if (strncasecmp(param, "q=", 2) == 0)
+						q = strtod(&param[2], NULL);
+				}
+			return q > 0;
+		}
+
+		accept = end;
+	}
+
+	return false;
+}
+#endif
+
+#if ENABLE_PNG
+/* Open admission control for raster jobs if the state file path was given
+ * with the EU_TIRE_LABEL_ADMISSION environment variable. */
+static struct admission *open_admission(void) {
+
+	const char *path, *tmp;
+	unsigned int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int queue;
+
+	if ((path = getenv("EU_TIRE_LABEL_ADMISSION")) == NULL)
+		return NULL;
+
+	if ((tmp = getenv("EU_TIRE_LABEL_RASTER_JOBS")) != NULL)
+		jobs = atoi(tmp);
+	queue = jobs * 4;
+	if ((tmp = getenv("EU_TIRE_LABEL_RASTER_QUEUE")) != NULL)
+		queue = atoi(tmp);
+
+	struct admission *admission;
+	if ((admission = admission_open(path, jobs, queue)) == NULL)
+		fprintf(stderr, "warning: couldn't open admission control: %s: %s\n", path, strerror(errno));
+	return admission;
+}
+#endif
+
+#if ENABLE_PNG
+/* Create the label background for thermal printers, i.e. the label template
+ * without any data. It is the same for all labels of the given regulation,
+ * so it can be stored in the printer memory only once. */
+static char *create_background_svg(bool label_EU_2020_740) {
+	const struct eu_tire_label empty = { 0 };
+	return label_EU_2020_740 ?
+		create_label_EU_2020_740(&empty) :
+		create_label_EC_1222_2009(&empty);
+}
+#endif
+
+#if ENABLE_PNG
+/* Rasterise SVG label into the given format. The background is required
+ * for the ZPL overlay and graphic formats only. Upon failure this function
+ * returns NULL. */
+static struct raster_image *raster_label(const struct raster_module *raster,
+		enum output_format format, const char *svg, const char *background,
+		int width, int height, int effort) {
+	switch (format) {
+	case FORMAT_ZPL:
+		return raster->svg_to_zpl(svg, NULL, width, height);
+	case FORMAT_ZPL_OVERLAY:
+		return raster->svg_to_zpl(svg, background, width, height);
+	case FORMAT_ZPL_GRAPHIC:
+		return raster->svg_to_zpl_graphic(background, width, height);
+	default:
+		break;
+	}
+	if (format == FORMAT_WEBP) {
+		if (raster->svg_to_webp == NULL) {
+			fprintf(stderr, "error: raster module without WebP support\n");
+			errno = ENOTSUP;
+			return NULL;
+		}
+		return raster->svg_to_webp(svg, width, height, effort);
+	}
+	(void)effort;
+	return raster->svg_to_png(svg, width, height);
+}
+#endif
+
+#if ENABLE_CGI
+static int batch_render_svg(const struct eu_tire_label *data, struct batch_label *label,
+		unsigned int threads, void *userdata) {
+
+	struct label_iov iov;
+	char *svg;
+
+	(void)threads;
+	(void)userdata;
+	if ((data->qrcode[0] != '\0' ?
+				create_label_iov_EU_2020_740(data, &iov) :
+				create_label_iov_EC_1222_2009(data, &iov)) == -1)
+		return -1;
+
+	svg = label_iov_join(&iov);
+	label->length = iov.length;
+	label_iov_free(&iov);
+
+	if (svg == NULL)
+		return -1;
+
+	label->data = label->handle = svg;
+	return 0;
+}
+
+static void batch_release_svg(struct batch_label *label, void *userdata) {
+	(void)userdata;
+	free(label->handle);
+}
+
+#if ENABLE_PNG
+struct batch_raster_renderer {
+	struct raster_module *raster;
+	enum output_format format;
+	int width;
+	int height;
+	int effort;
+	/* ZPL overlay backgrounds indexed by the label regulation */
+	char *backgrounds[2];
+};
+
+static int batch_render_raster(const struct eu_tire_label *data, struct batch_label *label,
+		unsigned int threads, void *userdata) {
+
+	struct batch_raster_renderer *renderer = userdata;
+	const char *background = renderer->backgrounds[data->qrcode[0] != '\0'];
+	struct raster_image *image;
+	struct batch_label svg;
+
+	if (batch_render_svg(data, &svg, 0, NULL) == -1)
+		return -1;
+
+	/* the limit is thread-local, so it applies to this worker only */
+	renderer->raster->set_threads(threads);
+	image = raster_label(renderer->raster, renderer->format, svg.data, background,
+			renderer->width, renderer->height, renderer->effort);
+	batch_release_svg(&svg, NULL);
+
+	if (image == NULL)
+		return -1;
+
+	label->data = image->data;
+	label->length = image->length;
+	label->handle = image;
+	return 0;
+}
+
+static void batch_release_raster(struct batch_label *label, void *userdata) {
+	struct batch_raster_renderer *renderer = userdata;
+	renderer->raster->image_free(label->handle);
+}
+#endif
+
+/* Handle the batch request: JSON array of label records is read from the
+ * request body, and all labels are returned in a single response. */
+static int respond_batch(enum output_format format, int width, int height,
+		int effort, enum batch_encoding encoding, const struct timespec *deadline) {
+
+	struct batch_renderer renderer = {
+		"image/svg+xml", batch_render_svg, batch_release_svg, NULL, width, height };
+	struct batch *batch = NULL;
+	size_t length = 0;
+	char *body = NULL;
+	const char *tmp;
+	int rv = EXIT_FAILURE;
+#if ENABLE_PNG
+	struct admission *admission = NULL;
+	struct raster_module raster = { 0 };
+	struct batch_raster_renderer raster_renderer = {
+		&raster, format, width, height, effort, { NULL, NULL } };
+#else
+	(void)width;
+	(void)height;
+	(void)effort;
+	(void)deadline;
+#endif
+
+#if ENABLE_PNG
+	/* the background is the same for every label in the batch, so there is
+	 * no point in storing it in the printer more than once */
+	if (format == FORMAT_ZPL_GRAPHIC) {
+		fprintf(stderr, "error: ZPL background store is not supported for batch requests\n");
+		fprintf(stdout, "Status: 400 Bad Request\r\n\r\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
+	if ((tmp = getenv("CONTENT_LENGTH")) != NULL)
+		length = strtoul(tmp, NULL, 10);
+	if (length > BATCH_MAX_LENGTH) {
+		fprintf(stderr, "error: batch request too large: %zu\n", length);
+		fprintf(stdout, "Status: 413 Payload Too Large\r\n\r\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((body = malloc(length + 1)) == NULL) {
+		perror("error: allocate batch request");
+		fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+		return EXIT_FAILURE;
+	}
+
+	if (fread(body, 1, length, stdin) != length) {
+		fprintf(stderr, "error: truncated batch request\n");
+		fprintf(stdout, "Status: 400 Bad Request\r\n\r\n");
+		goto final;
+	}
+
+	errno = 0;
+	if ((batch = batch_parse(body, length)) == NULL) {
+		if (errno == ENOMEM) {
+			perror("error: parse batch request");
+			fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+		}
+		else
+			fprintf(stdout, "Status: 400 Bad Request\r\n\r\n");
+		goto final;
+	}
+
+#if ENABLE_PNG
+	if (format != FORMAT_SVG) {
+		/* the whole batch is admitted as a single raster job */
+		if ((admission = open_admission()) != NULL &&
+				admission_acquire(admission, deadline) != ADMISSION_OK) {
+			fprintf(stderr, "error: raster job rejected by admission control\n");
+			fprintf(stdout, "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+			goto final;
+		}
+		if (raster_module_load(&raster) == -1) {
+			fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+			goto final;
+		}
+		/* backgrounds do not depend on the label data, so they are created
+		 * once for the whole batch */
+		if (format == FORMAT_ZPL_OVERLAY &&
+				((raster_renderer.backgrounds[0] = create_background_svg(false)) == NULL ||
+				 (raster_renderer.backgrounds[1] = create_background_svg(true)) == NULL)) {
+			perror("error: create label background");
+			fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+			goto final;
+		}
+		renderer.content_type = get_content_type(format);
+		renderer.render = batch_render_raster;
+		renderer.release = batch_release_raster;
+		renderer.userdata = &raster_renderer;
+	}
+#else
+	(void)format;
+#endif
+
+	fflush(stdout);
+	if (batch_respond(batch, &renderer, encoding,
+				sysconf(_SC_NPROCESSORS_ONLN), STDOUT_FILENO) == -1)
+		perror("error: write batch response");
+	rv = EXIT_SUCCESS;
+
+final:
+#if ENABLE_PNG
+	free(raster_renderer.backgrounds[0]);
+	free(raster_renderer.backgrounds[1]);
+	raster_module_unload(&raster);
+	admission_close(admission);
+#endif
+	batch_free(batch);
+	free(body);
+	return rv;
+}
+#endif
+
+/* Get the request deadline (CLOCK_MONOTONIC) based on the time limit given
+ * in milliseconds with the EU_TIRE_LABEL_DEADLINE environment variable. */
+static void get_request_deadline(struct timespec *deadline) {
+
+	long ms = 5000;
+	const char *tmp;
+
+	if ((tmp = getenv("EU_TIRE_LABEL_DEADLINE")) != NULL)
+		ms = atol(tmp);
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	if ((deadline->tv_nsec += (ms % 1000) * 1000000) >= 1000000000) {
+		deadline->tv_nsec -= 1000000000;
+		deadline->tv_sec++;
+	}
+
+}
+
 int main(int argc, char **argv) {
 
 	int opt;
@@ -99,8 +466,19 @@ int main(int argc, char **argv) {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "output-svg", no_argument, NULL, 's' },
+		{ "data-uri", no_argument, NULL, 'd' },
+		{ "html-img", no_argument, NULL, 'i' },
 #if ENABLE_PNG
 		{ "output-png", required_argument, NULL, 'p' },
+		{ "admission-stats", no_argument, NULL, 'a' },
+#endif
+#if ENABLE_WEBP
+		{ "output-webp", required_argument, NULL, 'w' },
+		{ "webp-effort", required_argument, NULL, 'e' },
+#endif
+#if ENABLE_PNG
+		{ "output-zpl", required_argument, NULL, 'z' },
+		{ "zpl-background", required_argument, NULL, 'b' },
 #endif
 		{ "svg-title", required_argument, NULL, 't' },
 		{ "eprel-url", required_argument, NULL, 'U' },
@@ -119,11 +497,53 @@ int main(int argc, char **argv) {
 
 	struct eu_tire_label data = { 0 };
 	enum output_format format = FORMAT_SVG;
+	enum output_embedding embed = EMBED_NONE;
 	bool label_EU_2020_740 = false;
-	char *label = NULL;
-	/* dimensions used for PNG output */
+	struct label_iov label = { 0 };
+	char *svg = NULL;
+	/* label template without data (ZPL background) */
+	char *background = NULL;
+	/* label in the requested output format */
+	struct iovec output_buffer;
+	const struct iovec *output = NULL;
+	size_t output_count = 0;
+	size_t output_length = 0;
+	/* label embedded into the data URI or HTML fragment */
+	char *embedded = NULL;
+	/* response headers, label and the trailing new line */
+	char headers[128] = "";
+	struct iovec *iov;
+	size_t iov_count = 0;
+	/* every request carries a deadline */
+	struct timespec deadline;
+#if ENABLE_PNG
+	struct admission *admission = NULL;
+	struct raster_module raster = { 0 };
+	struct raster_image *image = NULL;
+#endif
+#if ENABLE_CACHE
+	struct cache *cache = NULL;
+	unsigned char cache_key[CACHE_KEY_MAX];
+	size_t cache_key_length = 0;
+	const char *cache_path;
+	void *cached = NULL;
+#endif
+	/* dimensions used for raster output */
 	int width = -1;
 	int height = -1;
+	/* lossless WebP compression effort (0-9) */
+	int webp_effort = 6;
+#if ENABLE_PNG
+	/* thermal printer resolution and background mode */
+	int zpl_dpi = 0;
+	enum zpl_background zpl_background = ZPL_BACKGROUND_NONE;
+#endif
+	const char *env;
+
+	if ((env = getenv("EU_TIRE_LABEL_WEBP_EFFORT")) != NULL)
+		webp_effort = atoi(env);
+
+	get_request_deadline(&deadline);
 
 	/* parse options */
 	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
@@ -138,7 +558,20 @@ usage:
 #if ENABLE_PNG
 					"  --output-svg                 return label in the SVG format (default)\n"
 					"  --output-png=WIDTH[xHEIGHT]  return label in the PNG format\n"
+					"  --admission-stats            print PNG admission control statistics\n"
 #endif
+#if ENABLE_WEBP
+					"  --output-webp=WIDTH[xHEIGHT] return label in the lossless WebP format\n"
+					"  --webp-effort=LEVEL          WebP compression effort; allowed values:\n"
+					"                               0 (fastest) - 9 (smallest); default: 6\n"
+#endif
+#if ENABLE_PNG
+					"  --output-zpl=DPI             return label as ZPL for thermal printers\n"
+					"  --zpl-background=MODE        use label background stored in the printer;\n"
+					"                               MODE: store (download it) or recall\n"
+#endif
+					"  --data-uri                   return label embedded in the data URI\n"
+					"  --html-img                   return label as the HTML image element\n"
 					"  --svg-title=TEXT             tire label SVG image title\n"
 					"  -U, --eprel-url=URL          URL link to EPREL entry (for EU/2020/740)\n"
 					"  -M, --trademark=NAME         trademark string (for EU/2020/740)\n"
@@ -164,10 +597,53 @@ usage:
 		case 's' /* --output-svg */:
 			format = FORMAT_SVG;
 			break;
+		case 'd' /* --data-uri */:
+			embed = EMBED_DATAURI;
+			break;
+		case 'i' /* --html-img */:
+			embed = EMBED_HTML;
+			break;
+#if ENABLE_PNG
 		case 'p' /* --output-png=WIDTH[xHEIGHT] */:
 			format = FORMAT_PNG;
 			parse_label_dimensions(optarg, &width, &height);
 			break;
+#endif
+#if ENABLE_WEBP
+		case 'w' /* --output-webp=WIDTH[xHEIGHT] */:
+			format = FORMAT_WEBP;
+			parse_label_dimensions(optarg, &width, &height);
+			break;
+		case 'e' /* --webp-effort=LEVEL */:
+			webp_effort = atoi(optarg);
+			break;
+#endif
+#if ENABLE_PNG
+		case 'z' /* --output-zpl=DPI */:
+			format = FORMAT_ZPL;
+			zpl_dpi = atoi(optarg);
+			break;
+		case 'b' /* --zpl-background=MODE */:
+			if ((zpl_background = parse_zpl_background(optarg)) == ZPL_BACKGROUND_NONE) {
+				fprintf(stderr, "error: invalid ZPL background mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a' /* --admission-stats */ : {
+			struct admission_stats stats;
+			if ((admission = open_admission()) == NULL) {
+				fprintf(stderr, "error: admission control is not enabled\n");
+				return EXIT_FAILURE;
+			}
+			admission_get_stats(admission, &stats);
+			printf("running: %u\n" "waiting: %u\n" "admitted: %" PRIu64 "\n"
+					"shed-queue-full: %" PRIu64 "\n" "shed-deadline: %" PRIu64 "\n",
+					stats.running, stats.waiting, stats.admitted,
+					stats.shed_queue_full, stats.shed_deadline);
+			admission_close(admission);
+			return EXIT_SUCCESS;
+		}
+#endif
 		case 't' /* --svg-title=TEXT */:
 			strncpy(data.title, optarg, sizeof(data.title) - 1);
 			break;
@@ -222,12 +698,17 @@ usage:
 	/* detect whatever we are in the CGI environment, and if not, proceed
 	 * as a normal console-based application */
 	bool cgi = false;
+	bool batch = false;
+	bool negotiated = false;
+	enum batch_encoding batch_encoding = BATCH_MULTIPART;
 	const char *tmp;
 	if ((tmp = getenv("REQUEST_METHOD")) != NULL) {
 		cgi = true;
 
-		/* handle GET requests only */
-		if (strcmp(tmp, "GET") != 0) {
+		/* handle GET requests, and POST requests for a batch of labels */
+		if (strcmp(tmp, "POST") == 0)
+			batch = true;
+		else if (strcmp(tmp, "GET") != 0) {
 			fprintf(stdout, "Status: 405 Method Not Allowed\r\n\r\n");
 			return EXIT_FAILURE;
 		}
@@ -248,12 +729,50 @@ usage:
 				char *tmp = NULL;
 				str = NULL;
 
+				if (strcasecmp(token, "JSON") == 0) {
+					batch_encoding = BATCH_JSON;
+					continue;
+				}
+				if (strcasecmp(token, "DATAURI") == 0) {
+					embed = EMBED_DATAURI;
+					continue;
+				}
+				if (strcasecmp(token, "IMG") == 0) {
+					embed = EMBED_HTML;
+					continue;
+				}
+
 #if ENABLE_PNG
 				if (strcasestr(token, "PNG=") == token) {
 					format = FORMAT_PNG;
 					parse_label_dimensions(&token[4], &width, &height);
 				}
 #endif
+#if ENABLE_PNG
+				if (strcasestr(token, "ZPL=") == token) {
+					format = FORMAT_ZPL;
+					zpl_dpi = atoi(&token[4]);
+					continue;
+				}
+				if (strcasestr(token, "ZPLBG=") == token) {
+					zpl_background = parse_zpl_background(&token[6]);
+					continue;
+				}
+#endif
+#if ENABLE_WEBP
+				if (strcasestr(token, "WEBP=") == token) {
+					format = FORMAT_WEBP;
+					parse_label_dimensions(&token[5], &width, &height);
+					continue;
+				}
+#else
+				if (strcasestr(token, "WEBP=") == token) {
+					fprintf(stderr, "error: WebP output is not supported\n");
+					fprintf(stdout, "Status: 400 Bad Request\r\n\r\n");
+					free(query);
+					return EXIT_FAILURE;
+				}
+#endif
 
 				if (strcasestr(token, "U=") == token) {
 					strncpy(data.qrcode, tmp = urldecode(&token[2]), sizeof(data.qrcode) - 1);
@@ -275,9 +794,11 @@ usage:
 					data.rolling_noise = parse_rolling_noise_class(&token[2]);
 				else if (strcasestr(token, "N=") == token)
 					data.rolling_noise_db = parse_rolling_noise_db(&token[2]);
-				else if (strcasestr(token, "W") == token)
+				/* flags are matched exactly, so other parameters starting
+				 * with the same letter are not taken for them */
+				else if (strcasecmp(token, "W") == 0)
 					data.snow_grip = 1;
-				else if (strcasestr(token, "I") == token)
+				else if (strcasecmp(token, "I") == 0)
 					data.ice_grip = 1;
 
 				free(tmp);
@@ -286,10 +807,61 @@ usage:
 			free(query);
 		}
 
+		/* batch response encoding can be negotiated with the Accept header */
+		if ((tmp = getenv("HTTP_ACCEPT")) != NULL &&
+				http_accepts(tmp, "application/json"))
+			batch_encoding = BATCH_JSON;
+
+		/* batch labels are always embedded: data URIs are returned
+		 * in the JSON format and HTML image elements as a page */
+		if (embed == EMBED_DATAURI)
+			batch_encoding = BATCH_JSON;
+		if (embed == EMBED_HTML)
+			batch_encoding = BATCH_HTML;
+
+#if ENABLE_WEBP
+		/* Serve smaller WebP image to clients which support it. Note, that
+		 * the format falls back to PNG if the raster module does not support
+		 * WebP, which is known only after the module is loaded. */
+		if (!batch && format == FORMAT_PNG) {
+			negotiated = true;
+			if ((tmp = getenv("HTTP_ACCEPT")) != NULL &&
+					http_accepts(tmp, "image/webp"))
+				format = FORMAT_WEBP;
+		}
+#endif
+
+	}
+#endif
+
+#if ENABLE_PNG
+	/* ZPL label is rendered at the printer resolution, because the physical
+	 * label size is fixed by the regulation */
+	if (format == FORMAT_ZPL) {
+		if (zpl_dpi < 72 || zpl_dpi > 1200) {
+			fprintf(stderr, "error: invalid ZPL printer resolution: %d\n", zpl_dpi);
+#if ENABLE_CGI
+			if (cgi)
+				fprintf(stdout, "Status: 400 Bad Request\r\n\r\n");
+#endif
+			return EXIT_FAILURE;
+		}
+		width = (LABEL_WIDTH_MM * zpl_dpi * 10 + 127) / 254;
+		height = (LABEL_HEIGHT_MM * zpl_dpi * 10 + 127) / 254;
+		if (zpl_background == ZPL_BACKGROUND_RECALL)
+			format = FORMAT_ZPL_OVERLAY;
+		if (zpl_background == ZPL_BACKGROUND_STORE)
+			format = FORMAT_ZPL_GRAPHIC;
 	}
 #endif
 
-	if (data.tire_class == TC_ERROR) {
+#if ENABLE_CGI
+	if (batch)
+		return respond_batch(format, width, height, webp_effort, batch_encoding, &deadline);
+#endif
+
+	/* the background does not depend on the label data */
+	if (data.tire_class == TC_ERROR && format != FORMAT_ZPL_GRAPHIC) {
 		fprintf(stderr, "error: tire class option is required\n");
 #if ENABLE_CGI
 		if (cgi)
@@ -298,67 +870,208 @@ usage:
 		return EXIT_FAILURE;
 	}
 
-	if (sanitize_plain_text(data.title) != 0)
-		fprintf(stderr, "warning: found CDATA end sequence \"]]>\" in SVG title string\n");
-	if (sanitize_plain_text(data.trademark) != 0)
-		fprintf(stderr, "warning: found CDATA end sequence \"]]>\" in trademark string\n");
-	if (sanitize_plain_text(data.tire_type) != 0)
-		fprintf(stderr, "warning: found CDATA end sequence \"]]>\" in tire type string\n");
-	if (sanitize_plain_text(data.tire_size) != 0)
-		fprintf(stderr, "warning: found CDATA end sequence \"]]>\" in tire size string\n");
-
-	if (label_EU_2020_740)
-		label = create_label_EU_2020_740(&data);
-	else
-		label = create_label_EC_1222_2009(&data);
-	if (label == NULL) {
+#if ENABLE_CACHE
+	/* Shared cache is checked before rendering the label, so in the
+	 * fork-per-request mode (e.g. plain CGI) hot labels are served with
+	 * a single memory copy. */
+	if ((cache_path = getenv("EU_TIRE_LABEL_CACHE")) != NULL) {
+		if ((cache = cache_open(cache_path)) == NULL)
+			fprintf(stderr, "warning: couldn't open cache: %s: %s\n", cache_path, strerror(errno));
+		else {
+			cache_key_length = cache_label_key(cache_key, &data,
+					label_EU_2020_740, format, width, height,
+					format == FORMAT_WEBP ? webp_effort : 0);
+			if ((cached = cache_get(cache, cache_key, cache_key_length, &output_length)) != NULL)
+				goto output;
+			/* Concurrent requests for the same label are coalesced, so only
+			 * the first one renders it and the rest pick the result from the
+			 * cache. Every waiter is bounded by its own request deadline. */
+			if (cache_flight_begin(cache, cache_key, cache_key_length) == CACHE_FLIGHT_WAIT) {
+				if ((cached = cache_flight_wait(cache, cache_key, cache_key_length,
+								&output_length, &deadline)) != NULL)
+					goto output;
+				if (errno == ETIMEDOUT) {
+					fprintf(stderr, "error: timeout while waiting for coalesced render\n");
+#if ENABLE_CGI
+					if (cgi)
+						fprintf(stdout, "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+#endif
+					return EXIT_FAILURE;
+				}
+				/* the leader did not store the label in the cache (e.g. it
+				 * was too big), so render it independently */
+			}
+		}
+	}
+#endif
+
+	if ((label_EU_2020_740 ?
+				create_label_iov_EU_2020_740(&data, &label) :
+				create_label_iov_EC_1222_2009(&data, &label)) == -1) {
 		perror("error: create label");
 		return EXIT_FAILURE;
 	}
 
+	/* SVG label is emitted directly from the template segments */
+	output = label.iov;
+	output_count = label.count;
+	output_length = label.length;
+
 #if ENABLE_PNG
-	struct raster_png *png = NULL;
-	if (format == FORMAT_PNG &&
-			(png = raster_svg_to_png(label, width, height)) == NULL) {
-		perror("error: raster label to PNG");
-		return EXIT_FAILURE;
+	/* Raster module is loaded on demand, so SVG requests do not pay
+	 * the start-up cost of librsvg and all its dependencies. */
+	if (format != FORMAT_SVG) {
+		/* Limit the number of concurrent raster jobs, so cheap SVG requests
+		 * are not starved when a burst of PNG requests arrives. */
+		if ((admission = open_admission()) != NULL &&
+				admission_acquire(admission, &deadline) != ADMISSION_OK) {
+			fprintf(stderr, "error: raster job rejected by admission control\n");
+#if ENABLE_CGI
+			if (cgi)
+				fprintf(stdout, "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+#endif
+			return EXIT_FAILURE;
+		}
+		if (raster_module_load(&raster) == -1) {
+#if ENABLE_CGI
+			if (cgi)
+				fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+#endif
+			return EXIT_FAILURE;
+		}
+#if ENABLE_WEBP
+		if (negotiated && format == FORMAT_WEBP && raster.svg_to_webp == NULL) {
+			format = FORMAT_PNG;
+#if ENABLE_CACHE
+			/* the PNG label might have been cached already */
+			if (cache != NULL) {
+				cache_flight_end(cache);
+				cache_key_length = cache_label_key(cache_key, &data,
+						label_EU_2020_740, format, width, height, 0);
+				if ((cached = cache_get(cache, cache_key, cache_key_length, &output_length)) != NULL) {
+					admission_close(admission);
+					admission = NULL;
+					goto output;
+				}
+			}
+#endif
+		}
+#endif
+		if ((format == FORMAT_ZPL_OVERLAY || format == FORMAT_ZPL_GRAPHIC) &&
+				(background = create_background_svg(label_EU_2020_740)) == NULL) {
+			perror("error: create label background");
+#if ENABLE_CGI
+			if (cgi)
+				fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+#endif
+			return EXIT_FAILURE;
+		}
+		if ((svg = label_iov_join(&label)) == NULL ||
+				(image = raster_label(&raster, format, svg, background,
+					width, height, webp_effort)) == NULL) {
+			perror("error: raster label");
+#if ENABLE_CGI
+			if (cgi)
+				fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
+#endif
+			return EXIT_FAILURE;
+		}
+		output_buffer.iov_base = image->data;
+		output_buffer.iov_len = image->length;
+		output = &output_buffer;
+		output_count = 1;
+		output_length = image->length;
+		admission_close(admission);
+		admission = NULL;
+	}
+#endif
+
+#if ENABLE_CACHE
+	if (cache != NULL) {
+		if (output_count == 1)
+			cache_put(cache, cache_key, cache_key_length, output->iov_base, output_length);
+		else if ((svg = label_iov_join(&label)) != NULL)
+			cache_put(cache, cache_key, cache_key_length, svg, output_length);
+		cache_flight_end(cache);
+	}
+output:
+	if (cached != NULL) {
+		output_buffer.iov_base = cached;
+		output_buffer.iov_len = output_length;
+		output = &output_buffer;
+		output_count = 1;
 	}
 #endif
 
+	/* Label is embedded after the cache lookup, so the cache holds raw
+	 * labels only. Data URI is encoded directly into the final buffer. */
+	if (embed != EMBED_NONE) {
+		const enum datauri_encoding encoding = format == FORMAT_SVG ?
+			DATAURI_PERCENT : DATAURI_BASE64;
+		if ((embedded = embed == EMBED_HTML ?
+					datauri_img_dup(get_content_type(format), output, output_count, encoding,
+						data.title[0] != '\0' ? data.title : "EU tire label",
+						width, height, &output_length) :
+					datauri_dup(get_content_type(format), output, output_count, encoding,
+						&output_length)) == NULL) {
+			perror("error: embed label");
 #if ENABLE_CGI
-	if (cgi) {
-		fprintf(stdout, "Status: 200 OK\r\n");
-		switch (format) {
-		case FORMAT_SVG:
-			fprintf(stdout, "Content-Type: image/svg+xml\r\n");
-			fprintf(stdout, "Content-Length: %zu\r\n", strlen(label));
-			break;
-#if ENABLE_PNG
-		case FORMAT_PNG:
-			fprintf(stdout, "Content-Type: image/png\r\n");
-			fprintf(stdout, "Content-Length: %zu\r\n", png->length);
-			break;
+			if (cgi)
+				fprintf(stdout, "Status: 500 Internal Server Error\r\n\r\n");
 #endif
+			return EXIT_FAILURE;
 		}
-		fprintf(stdout, "\r\n");
+		output_buffer.iov_base = embedded;
+		output_buffer.iov_len = output_length;
+		output = &output_buffer;
+		output_count = 1;
 	}
-#endif
 
-	/* dump created label to the standard output */
-	switch (format) {
-	case FORMAT_SVG:
-		fprintf(stdout, "%s\n", label);
-		break;
-#if ENABLE_PNG
-	case FORMAT_PNG:
-		fwrite(png->data, png->length, 1, stdout);
-		break;
+#if ENABLE_CGI
+	if (cgi) {
+		snprintf(headers, sizeof(headers), "Status: 200 OK\r\n"
+				"Content-Type: %s\r\n" "Content-Length: %zu\r\n" "%s\r\n",
+				embed == EMBED_HTML ? "text/html; charset=utf-8" :
+				embed == EMBED_DATAURI ? "text/plain" : get_content_type(format),
+				output_length,
+				negotiated ? "Vary: Accept\r\n" : "");
+	}
 #endif
+
+	if ((iov = malloc((output_count + 2) * sizeof(*iov))) == NULL) {
+		perror("error: allocate output");
+		return EXIT_FAILURE;
 	}
 
+	/* dump created label to the standard output with a single system call */
+	if (headers[0] != '\0') {
+		iov[iov_count].iov_base = headers;
+		iov[iov_count++].iov_len = strlen(headers);
+	}
+	memcpy(&iov[iov_count], output, output_count * sizeof(*iov));
+	iov_count += output_count;
+	if (format == FORMAT_SVG || embed != EMBED_NONE) {
+		iov[iov_count].iov_base = "\n";
+		iov[iov_count++].iov_len = 1;
+	}
+
+	fflush(stdout);
+	if (output_writev(STDOUT_FILENO, iov, iov_count) == -1)
+		perror("error: write label");
+	free(iov);
+
 #if ENABLE_PNG
-	raster_png_free(png);
+	if (image != NULL)
+		raster.image_free(image);
+	raster_module_unload(&raster);
+#endif
+#if ENABLE_CACHE
+	free(cached);
+	cache_close(cache);
 #endif
-	free(label);
+	label_iov_free(&label);
+	free(embedded);
+	free(background);
+	free(svg);
 	return EXIT_SUCCESS;
 }
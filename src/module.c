@@ -0,0 +1,58 @@
+/*
+ * EU-tire-label - module.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "module.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Load raster module. The module path can be overridden with the
+ * EU_TIRE_LABEL_RASTER_MODULE environment variable. Upon failure this
+ * function prints the error message and returns -1. */
+int raster_module_load(struct raster_module *module) {
+
+	const char *path;
+
+	if ((path = getenv("EU_TIRE_LABEL_RASTER_MODULE")) == NULL)
+		path = RASTER_MODULE_PATH;
+
+	if ((module->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+		goto fail;
+
+	*(void **)&module->svg_to_png = dlsym(module->handle, "raster_svg_to_png");
+	*(void **)&module->svg_to_zpl = dlsym(module->handle, "raster_svg_to_zpl");
+	*(void **)&module->svg_to_zpl_graphic = dlsym(module->handle, "raster_svg_to_zpl_graphic");
+	*(void **)&module->image_free = dlsym(module->handle, "raster_image_free");
+	*(void **)&module->set_threads = dlsym(module->handle, "raster_set_threads");
+	if (module->svg_to_png == NULL ||
+			module->svg_to_zpl == NULL ||
+			module->svg_to_zpl_graphic == NULL ||
+			module->image_free == NULL ||
+			module->set_threads == NULL)
+		goto fail;
+
+	/* optional symbols */
+	dlerror();
+	*(void **)&module->svg_to_webp = dlsym(module->handle, "raster_svg_to_webp");
+
+	return 0;
+
+fail:
+	fprintf(stderr, "error: load raster module: %s\n", dlerror());
+	raster_module_unload(module);
+	return -1;
+}
+
+void raster_module_unload(struct raster_module *module) {
+	if (module->handle != NULL)
+		dlclose(module->handle);
+	module->handle = NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ * EU-tire-label - module.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_MODULE_H_
+#define EUTIRELABEL_MODULE_H_
+
+#include "raster.h"
+
+/* Raster functions loaded from the loadable module, so the SVG-only
+ * invocations do not pay the cost of linking librsvg and its dependencies. */
+struct raster_module {
+	void *handle;
+	struct raster_image *(*svg_to_png)(const char *svg, int width, int height);
+	/* NULL if the module was built without WebP support */
+	struct raster_image *(*svg_to_webp)(const char *svg, int width, int height, int effort);
+	struct raster_image *(*svg_to_zpl)(const char *svg, const char *background,
+			int width, int height);
+	struct raster_image *(*svg_to_zpl_graphic)(const char *svg, int width, int height);
+	void (*image_free)(struct raster_image *image);
+	void (*set_threads)(int threads);
+};
+
+int raster_module_load(struct raster_module *module);
+void raster_module_unload(struct raster_module *module);
+
+#endif
@@ -0,0 +1,689 @@
+/*
+ * EU-tire-label - outline.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "outline.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Single glyph outline in the SVG path data format. Coordinates are stored
+ * as integers with 1000 units per EM and Y axis pointing downwards. */
+struct outline_glyph {
+	int advance;
+	const char *path;
+};
+
+/* auto-generated glyph outlines */
+#include "font_regular-outlines.h"
+#include "font_bold-outlines.h"
+
+/* maximal supported depth of the SVG element tree */
+#define OUTLINE_MAX_DEPTH 32
+/* maximal number of CSS rules in the SVG style element */
+#define OUTLINE_MAX_RULES 16
+/* maximal number of text chunks (text or tspan) in a single text element */
+#define OUTLINE_MAX_RUNS 8
+
+enum text_anchor {
+	ANCHOR_START = 0,
+	ANCHOR_MIDDLE,
+	ANCHOR_END,
+};
+
+struct text_style {
+	double font_size;
+	bool bold;
+	enum text_anchor anchor;
+};
+
+struct css_rule {
+	const char *selector;
+	size_t selector_len;
+	const char *decl;
+	size_t decl_len;
+};
+
+struct buffer {
+	char *data;
+	size_t length;
+	size_t size;
+	bool error;
+};
+
+struct text_run {
+	struct text_style style;
+	struct buffer text;
+	const char *fill;
+	size_t fill_len;
+};
+
+static void buffer_append(struct buffer *b, const char *data, size_t length) {
+
+	if (b->error)
+		return;
+
+	if (b->length + length + 1 > b->size) {
+		size_t size = b->size * 2 + length + 1;
+		char *tmp;
+		if ((tmp = realloc(b->data, size)) == NULL) {
+			b->error = true;
+			return;
+		}
+		b->data = tmp;
+		b->size = size;
+	}
+
+	memcpy(&b->data[b->length], data, length);
+	b->length += length;
+	b->data[b->length] = '\0';
+
+}
+
+static void buffer_append_str(struct buffer *b, const char *str) {
+	buffer_append(b, str, strlen(str));
+}
+
+/* Append number with up to three decimal places to the buffer. */
+static void buffer_append_number(struct buffer *b, double value) {
+
+	char tmp[32];
+	int len = snprintf(tmp, sizeof(tmp), "%.3f", value);
+
+	while (len > 1 && tmp[len - 1] == '0')
+		tmp[--len] = '\0';
+	if (tmp[len - 1] == '.')
+		tmp[--len] = '\0';
+	if (strcmp(tmp, "-0") == 0)
+		strcpy(tmp, "0");
+
+	buffer_append_str(b, tmp);
+}
+
+/* Append Unicode code point to the buffer using UTF-8 encoding. */
+static void buffer_append_utf8(struct buffer *b, unsigned long cp) {
+
+	char tmp[4];
+
+	if (cp < 0x80) {
+		tmp[0] = cp;
+		buffer_append(b, tmp, 1);
+	}
+	else if (cp < 0x800) {
+		tmp[0] = 0xC0 | (cp >> 6);
+		tmp[1] = 0x80 | (cp & 0x3F);
+		buffer_append(b, tmp, 2);
+	}
+	else {
+		/* glyphs outside of the Latin-1 range are not supported */
+		buffer_append(b, "?", 1);
+	}
+
+}
+
+/* Get next glyph from the UTF-8 encoded string. Characters for which there
+ * is no outline in the glyph table are replaced with the question mark. */
+static const struct outline_glyph *glyph_next(const char **text, bool bold) {
+
+	const struct outline_glyph *glyphs = bold ? font_bold_outlines : font_regular_outlines;
+	const unsigned char *p = (const unsigned char *)*text;
+	unsigned long cp = *p++;
+
+	if ((cp & 0xE0) == 0xC0 && (*p & 0xC0) == 0x80)
+		cp = ((cp & 0x1F) << 6) | (*p++ & 0x3F);
+	else if (cp >= 0x80) {
+		/* skip the whole multi-byte sequence */
+		while ((*p & 0xC0) == 0x80)
+			p++;
+		cp = '?';
+	}
+
+	*text = (const char *)p;
+
+	if (cp >= 0x20 && cp <= 0x7E)
+		return &glyphs[cp - 0x20];
+	if (cp >= 0xA0 && cp <= 0xFF)
+		return &glyphs[cp - 0xA0 + 0x7F - 0x20];
+	return &glyphs['?' - 0x20];
+}
+
+/* Get the value of the attribute from the tag delimited by the start and
+ * the end pointers. Upon success this function returns true. */
+static bool tag_attr(const char *tag, const char *end, const char *name,
+		const char **value, size_t *length) {
+
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = tag + 1; p + len + 2 < end; p++) {
+		if (!isspace(p[-1]) || strncmp(p, name, len) != 0 || p[len] != '=')
+			continue;
+		char quote = p[len + 1];
+		if (quote != '"' && quote != '\'')
+			continue;
+		const char *v = &p[len + 2];
+		const char *e = memchr(v, quote, end - v);
+		if (e == NULL)
+			return false;
+		*value = v;
+		*length = e - v;
+		return true;
+	}
+
+	return false;
+}
+
+/* Check whether the class attribute of the tag contains given class. */
+static bool tag_has_class(const char *tag, const char *end,
+		const char *name, size_t name_len) {
+
+	const char *value;
+	size_t length;
+
+	if (!tag_attr(tag, end, "class", &value, &length))
+		return false;
+
+	while (length > 0) {
+		size_t n = 0;
+		while (n < length && !isspace(value[n]))
+			n++;
+		if (n == name_len && strncmp(value, name, n) == 0)
+			return true;
+		while (n < length && isspace(value[n]))
+			n++;
+		value += n;
+		length -= n;
+	}
+
+	return false;
+}
+
+static void style_apply_property(struct text_style *style,
+		const char *name, size_t name_len, const char *value, size_t value_len) {
+
+	char tmp[32];
+
+	if (value_len >= sizeof(tmp))
+		return;
+	memcpy(tmp, value, value_len);
+	tmp[value_len] = '\0';
+
+	if (name_len == 9 && strncmp(name, "font-size", 9) == 0) {
+		double size = strtod(tmp, NULL);
+		if (size > 0)
+			style->font_size = size;
+	}
+	else if (name_len == 11 && strncmp(name, "font-weight", 11) == 0) {
+		if (strcmp(tmp, "bold") == 0 || strcmp(tmp, "bolder") == 0)
+			style->bold = true;
+		else if (strcmp(tmp, "normal") == 0 || strcmp(tmp, "lighter") == 0)
+			style->bold = false;
+		else if (isdigit(tmp[0]))
+			style->bold = atoi(tmp) >= 600;
+	}
+	else if (name_len == 11 && strncmp(name, "text-anchor", 11) == 0) {
+		if (strcmp(tmp, "start") == 0)
+			style->anchor = ANCHOR_START;
+		else if (strcmp(tmp, "middle") == 0)
+			style->anchor = ANCHOR_MIDDLE;
+		else if (strcmp(tmp, "end") == 0)
+			style->anchor = ANCHOR_END;
+	}
+
+}
+
+/* Apply CSS declaration block (e.g. "font-size: 5px; font-weight: bold")
+ * to the given text style. */
+static void style_apply_css(struct text_style *style, const char *decl, size_t length) {
+
+	const char *end = decl + length;
+
+	while (decl < end) {
+
+		const char *semicolon, *colon;
+		if ((semicolon = memchr(decl, ';', end - decl)) == NULL)
+			semicolon = end;
+
+		if ((colon = memchr(decl, ':', semicolon - decl)) != NULL) {
+
+			const char *name = decl, *name_end = colon;
+			const char *value = colon + 1, *value_end = semicolon;
+
+			while (name < name_end && isspace(*name))
+				name++;
+			while (name_end > name && isspace(name_end[-1]))
+				name_end--;
+			while (value < value_end && isspace(*value))
+				value++;
+			while (value_end > value && isspace(value_end[-1]))
+				value_end--;
+
+			style_apply_property(style, name, name_end - name, value, value_end - value);
+
+		}
+
+		decl = semicolon + 1;
+	}
+
+}
+
+/* Compute style of the element. Note, that presentation attributes have
+ * lower precedence than any CSS rule. */
+static void style_apply_element(struct text_style *style,
+		const char *tag, const char *end, const char *name, size_t name_len,
+		const struct css_rule *rules, size_t rules_count) {
+
+	static const char *attrs[] = { "font-size", "font-weight", "text-anchor" };
+	const char *value;
+	size_t i, length;
+
+	for (i = 0; i < sizeof(attrs) / sizeof(*attrs); i++)
+		if (tag_attr(tag, end, attrs[i], &value, &length))
+			style_apply_property(style, attrs[i], strlen(attrs[i]), value, length);
+
+	/* element type selectors */
+	for (i = 0; i < rules_count; i++)
+		if (rules[i].selector_len == name_len &&
+				strncmp(rules[i].selector, name, name_len) == 0)
+			style_apply_css(style, rules[i].decl, rules[i].decl_len);
+
+	/* class selectors */
+	for (i = 0; i < rules_count; i++) {
+		const char *dot = memchr(rules[i].selector, '.', rules[i].selector_len);
+		if (dot == NULL)
+			continue;
+		const char *class = dot + 1;
+		size_t class_len = rules[i].selector_len - (class - rules[i].selector);
+		if (dot - rules[i].selector != 0 && ((size_t)(dot - rules[i].selector) != name_len ||
+					strncmp(rules[i].selector, name, name_len) != 0))
+			continue;
+		if (tag_has_class(tag, end, class, class_len))
+			style_apply_css(style, rules[i].decl, rules[i].decl_len);
+	}
+
+}
+
+/* Parse simple CSS rules from the SVG style element. Only element type and
+ * class selectors are supported. */
+static size_t parse_css_rules(const char *svg, struct css_rule *rules, size_t size) {
+
+	const char *p, *end;
+	size_t count = 0;
+
+	if ((p = strstr(svg, "<style")) == NULL ||
+			(p = strchr(p, '>')) == NULL ||
+			(end = strstr(p, "</style>")) == NULL)
+		return 0;
+
+	p++;
+	while (p < end) {
+
+		const char *open, *close;
+		if ((open = memchr(p, '{', end - p)) == NULL ||
+				(close = memchr(open, '}', end - open)) == NULL)
+			break;
+
+		/* split selector group into separate rules */
+		while (p < open) {
+
+			const char *comma;
+			if ((comma = memchr(p, ',', open - p)) == NULL)
+				comma = open;
+
+			const char *s = p, *e = comma;
+			while (s < e && (isspace(*s) || *s == '<' || *s == '!' || *s == '['))
+				s++;
+			while (e > s && isspace(e[-1]))
+				e--;
+
+			if (s < e && count < size) {
+				rules[count].selector = s;
+				rules[count].selector_len = e - s;
+				rules[count].decl = open + 1;
+				rules[count].decl_len = close - open - 1;
+				count++;
+			}
+
+			p = comma + 1;
+		}
+
+		p = close + 1;
+	}
+
+	return count;
+}
+
+/* Append text with XML entities decoded to the buffer. */
+static void append_decoded(struct buffer *b, const char *text, size_t length) {
+
+	const char *end = text + length;
+
+	while (text < end) {
+
+		const char *semicolon;
+		if (*text != '&' || (semicolon = memchr(text, ';', end - text)) == NULL) {
+			buffer_append(b, isspace(*text) ? " " : text, 1);
+			text++;
+			continue;
+		}
+
+		const char *entity = text + 1;
+		size_t len = semicolon - entity;
+
+		if (len == 3 && strncmp(entity, "amp", 3) == 0)
+			buffer_append(b, "&", 1);
+		else if (len == 2 && strncmp(entity, "lt", 2) == 0)
+			buffer_append(b, "<", 1);
+		else if (len == 2 && strncmp(entity, "gt", 2) == 0)
+			buffer_append(b, ">", 1);
+		else if (len == 4 && strncmp(entity, "quot", 4) == 0)
+			buffer_append(b, "\"", 1);
+		else if (len == 4 && strncmp(entity, "apos", 4) == 0)
+			buffer_append(b, "'", 1);
+		else if (len > 1 && entity[0] == '#')
+			buffer_append_utf8(b, entity[1] == 'x' ?
+					strtoul(&entity[2], NULL, 16) : strtoul(&entity[1], NULL, 10));
+		else
+			buffer_append(b, text, semicolon + 1 - text);
+
+		text = semicolon + 1;
+	}
+
+}
+
+/* Collapse white spaces in all text runs according to the default value of
+ * the xml:space attribute. */
+static void collapse_white_spaces(struct text_run *runs, size_t count) {
+
+	bool space = true;
+	size_t i, j, n;
+
+	for (i = 0; i < count; i++) {
+		struct buffer *b = &runs[i].text;
+		for (j = n = 0; j < b->length; j++) {
+			if (b->data[j] == ' ' && space)
+				continue;
+			space = b->data[j] == ' ';
+			b->data[n++] = b->data[j];
+		}
+		b->length = n;
+		if (b->data != NULL)
+			b->data[n] = '\0';
+	}
+
+	/* strip trailing white space */
+	for (i = count; i > 0; i--) {
+		struct buffer *b = &runs[i - 1].text;
+		if (b->length == 0)
+			continue;
+		if (b->data[b->length - 1] == ' ')
+			b->data[--b->length] = '\0';
+		break;
+	}
+
+}
+
+static double text_run_width(const struct text_run *run) {
+
+	const char *p = run->text.data;
+	double width = 0;
+
+	if (p == NULL)
+		return 0;
+
+	while (*p != '\0')
+		width += glyph_next(&p, run->style.bold)->advance;
+
+	return width * run->style.font_size / 1000;
+}
+
+/* Append outlines of the text run to the buffer. The x pointer is updated
+ * with the position of the pen after the last glyph. */
+static void append_text_run_path(struct buffer *b, const struct text_run *run,
+		double *x, double y) {
+
+	const double scale = run->style.font_size / 1000;
+	const char *p = run->text.data;
+
+	while (p != NULL && *p != '\0') {
+
+		const struct outline_glyph *glyph = glyph_next(&p, run->style.bold);
+		const char *d = glyph->path;
+		bool is_x = true;
+
+		while (*d != '\0') {
+
+			if (isalpha(*d)) {
+				buffer_append(b, d++, 1);
+				is_x = true;
+				continue;
+			}
+
+			if (*d == ' ') {
+				d++;
+				continue;
+			}
+
+			char *tmp;
+			long value = strtol(d, &tmp, 10);
+			d = tmp;
+
+			if (b->length > 0 && !isalpha(b->data[b->length - 1]))
+				buffer_append(b, " ", 1);
+			buffer_append_number(b, is_x ? *x + value * scale : y + value * scale);
+			is_x = !is_x;
+
+		}
+
+		*x += glyph->advance * scale;
+	}
+
+}
+
+/* Convert single text element into a group of path elements. The tag
+ * parameter shall point to the beginning of the text element start tag and
+ * the end parameter to the beginning of the text element end tag. */
+static void outline_text_element(struct buffer *out, const char *tag, const char *end,
+		const struct text_style *parent, const struct css_rule *rules, size_t rules_count) {
+
+	const char *tag_end = strchr(tag, '>');
+	struct text_run runs[OUTLINE_MAX_RUNS] = { 0 };
+	struct text_style style = *parent;
+	size_t i, count = 1;
+	const char *value;
+	size_t length;
+	double x = 0, y = 0;
+	double width = 0;
+
+	style_apply_element(&style, tag, tag_end, "text", 4, rules, rules_count);
+	if (tag_attr(tag, tag_end, "x", &value, &length))
+		x = strtod(value, NULL);
+	if (tag_attr(tag, tag_end, "y", &value, &length))
+		y = strtod(value, NULL);
+
+	runs[0].style = style;
+
+	const char *p = tag_end + 1;
+	while (p < end) {
+
+		struct text_run *run = &runs[count - 1];
+		const char *next;
+
+		if (*p != '<') {
+			if ((next = memchr(p, '<', end - p)) == NULL)
+				next = end;
+			append_decoded(&run->text, p, next - p);
+			p = next;
+			continue;
+		}
+
+		if (strncmp(p, "<![CDATA[", 9) == 0) {
+			if ((next = strstr(p + 9, "]]>")) == NULL || next > end)
+				next = end;
+			buffer_append(&run->text, p + 9, next - p - 9);
+			p = next + 3;
+			continue;
+		}
+
+		if ((next = memchr(p, '>', end - p)) == NULL)
+			break;
+
+		if (strncmp(p, "<tspan", 6) == 0 && (isspace(p[6]) || p[6] == '>')) {
+			if (count == OUTLINE_MAX_RUNS)
+				break;
+			run = &runs[count++];
+			run->style = style;
+			style_apply_element(&run->style, p, next, "tspan", 5, rules, rules_count);
+			tag_attr(p, next, "fill", &run->fill, &run->fill_len);
+		}
+		else if (strncmp(p, "</tspan>", 8) == 0) {
+			if (count == OUTLINE_MAX_RUNS)
+				break;
+			run = &runs[count++];
+			run->style = style;
+		}
+
+		p = next + 1;
+	}
+
+	collapse_white_spaces(runs, count);
+
+	for (i = 0; i < count; i++)
+		width += text_run_width(&runs[i]);
+	if (style.anchor == ANCHOR_MIDDLE)
+		x -= width / 2;
+	else if (style.anchor == ANCHOR_END)
+		x -= width;
+
+	/* Replace text element with a group, so all inheritable presentation
+	 * attributes (e.g. fill or transform) are applied to outlines. */
+	buffer_append(out, "<g", 2);
+	buffer_append(out, tag + 5, tag_end - tag - 5);
+	buffer_append(out, ">", 1);
+
+	for (i = 0; i < count; i++) {
+		if (runs[i].text.length == 0)
+			continue;
+		buffer_append_str(out, "<path");
+		if (runs[i].fill != NULL) {
+			buffer_append_str(out, " fill=\"");
+			buffer_append(out, runs[i].fill, runs[i].fill_len);
+			buffer_append(out, "\"", 1);
+		}
+		buffer_append_str(out, " d=\"");
+		append_text_run_path(out, &runs[i], &x, y);
+		buffer_append_str(out, "\"/>");
+	}
+
+	buffer_append_str(out, "</g>");
+
+	for (i = 0; i < count; i++) {
+		if (runs[i].text.error)
+			out->error = true;
+		free(runs[i].text.data);
+	}
+
+}
+
+char *outline_svg_text(const char *svg, bool static_only) {
+
+	struct css_rule rules[OUTLINE_MAX_RULES];
+	struct text_style styles[OUTLINE_MAX_DEPTH];
+	struct buffer out = { 0 };
+	size_t rules_count;
+	size_t depth = 0;
+	const char *p = svg;
+
+	rules_count = parse_css_rules(svg, rules, OUTLINE_MAX_RULES);
+
+	/* initial values of CSS properties */
+	styles[0].font_size = 16;
+	styles[0].bold = false;
+	styles[0].anchor = ANCHOR_START;
+
+	/* reserve space for the whole input in one go */
+	out.size = strlen(svg) + 1;
+	if ((out.data = malloc(out.size)) == NULL)
+		return NULL;
+	out.data[0] = '\0';
+
+	while (*p != '\0') {
+
+		const struct text_style *parent = &styles[depth < OUTLINE_MAX_DEPTH ? depth : OUTLINE_MAX_DEPTH - 1];
+		const char *next, *tag_end;
+
+		if (*p != '<') {
+			if ((next = strchr(p, '<')) == NULL)
+				next = p + strlen(p);
+			buffer_append(&out, p, next - p);
+			p = next;
+			continue;
+		}
+
+		if (strncmp(p, "<![CDATA[", 9) == 0 || strncmp(p, "<!--", 4) == 0) {
+			const char *term = p[2] == '[' ? "]]>" : "-->";
+			if ((next = strstr(p + 4, term)) == NULL)
+				next = p + strlen(p);
+			else
+				next += 3;
+			buffer_append(&out, p, next - p);
+			p = next;
+			continue;
+		}
+
+		if ((tag_end = strchr(p, '>')) == NULL) {
+			buffer_append_str(&out, p);
+			break;
+		}
+
+		next = tag_end + 1;
+
+		if (p[1] == '/') {
+			if (depth > 0)
+				depth--;
+		}
+		else if (strncmp(p, "<text", 5) == 0 && (isspace(p[5]) || p[5] == '>')) {
+			const char *text_end;
+			if ((text_end = strstr(next, "</text>")) == NULL) {
+				buffer_append_str(&out, p);
+				break;
+			}
+			/* text with template placeholders has to be processed later */
+			if (!static_only || memchr(p, '[', text_end - p) == NULL) {
+				outline_text_element(&out, p, text_end, parent, rules, rules_count);
+				p = text_end + 7;
+				continue;
+			}
+			next = text_end + 7;
+		}
+		else if (p[1] != '!' && p[1] != '?' && tag_end[-1] != '/') {
+			const char *name = p + 1;
+			size_t name_len = 0;
+			while (isalnum(name[name_len]) || name[name_len] == '-')
+				name_len++;
+			if (++depth < OUTLINE_MAX_DEPTH) {
+				styles[depth] = *parent;
+				style_apply_element(&styles[depth], p, tag_end, name, name_len,
+						rules, rules_count);
+			}
+		}
+
+		buffer_append(&out, p, next - p);
+		p = next;
+	}
+
+	if (out.error) {
+		free(out.data);
+		return NULL;
+	}
+
+	return out.data;
+}
@@ -0,0 +1,23 @@
+/*
+ * EU-tire-label - outline.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_OUTLINE_H_
+#define EUTIRELABEL_OUTLINE_H_
+
+#include <stdbool.h>
+
+/* Convert SVG text elements into path outlines using the embedded glyph
+ * table. If static_only is true, text elements which contain template
+ * placeholders are left intact. Memory for the new string is obtained with
+ * malloc(3), and can be freed with free(3). */
+char *outline_svg_text(const char *svg, bool static_only);
+
+#endif
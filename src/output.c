@@ -0,0 +1,45 @@
+/*
+ * EU-tire-label - output.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "output.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+
+/* Write all given buffers to the file descriptor. This function modifies
+ * the iovec array in case of a partial write. */
+int output_writev(int fd, struct iovec *iov, size_t count) {
+
+	while (count > 0) {
+
+		ssize_t rv;
+		if ((rv = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (count > 0 && (size_t)rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+
+	}
+
+	return 0;
+}
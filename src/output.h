@@ -0,0 +1,20 @@
+/*
+ * EU-tire-label - output.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_OUTPUT_H_
+#define EUTIRELABEL_OUTPUT_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+int output_writev(int fd, struct iovec *iov, size_t count);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ * EU-tire-label - pngenc.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "pngenc.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+/* Minimal number of uncompressed bytes per block. Every block except the
+ * first one uses the preceding 32 KiB of data as a dictionary, so smaller
+ * blocks would hurt compression ratio more than they help. */
+#define PNGENC_BLOCK_MIN_LENGTH (256 * 1024)
+/* maximal number of blocks compressed in parallel */
+#define PNGENC_BLOCKS_MAX 16
+/* the same compression level as libpng uses by default */
+#define PNGENC_LEVEL 6
+/* maximal size of the deflate dictionary */
+#define PNGENC_DICT_LENGTH 32768
+
+enum pngenc_filter {
+	FILTER_NONE = 0,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVERAGE,
+	FILTER_PAETH,
+};
+
+struct pngenc_block {
+	const unsigned char *data;
+	int width;
+	int stride;
+	/* range of rows in this block */
+	int y0, y1;
+	bool last;
+	/* compressed data */
+	unsigned char *out;
+	size_t out_length;
+	/* checksums of uncompressed and compressed data */
+	unsigned long adler;
+	size_t in_length;
+	unsigned long crc;
+	bool ok;
+};
+
+static void put_uint32(unsigned char *dst, uint32_t value) {
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+/* Convert row of the Cairo RGB24 pixels (native-endian 0x00RRGGBB words)
+ * into 8-bit RGB triplets. */
+static void convert_row(const unsigned char *src, int width, unsigned char *rgb) {
+	const uint32_t *pixels = (const uint32_t *)src;
+	int x;
+	for (x = 0; x < width; x++) {
+		*rgb++ = pixels[x] >> 16;
+		*rgb++ = pixels[x] >> 8;
+		*rgb++ = pixels[x];
+	}
+}
+
+static unsigned char paeth(unsigned char a, unsigned char b, unsigned char c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* Filter single row of RGB data. The filter type is selected with the
+ * minimum sum of absolute differences heuristic (the same as libpng uses
+ * by default). The output buffer shall be 1 + length bytes long. */
+static void filter_row(const unsigned char *prev, const unsigned char *row,
+		size_t length, unsigned char *candidates, unsigned char *out) {
+
+	const size_t bpp = 3;
+	unsigned long best_sum = ~0UL;
+	int best = FILTER_NONE;
+	int f;
+
+	for (f = FILTER_NONE; f <= FILTER_PAETH; f++) {
+
+		unsigned char *dst = &candidates[f * length];
+		unsigned long sum = 0;
+		size_t i;
+
+		for (i = 0; i < length; i++) {
+			unsigned char a = i >= bpp ? row[i - bpp] : 0;
+			unsigned char b = prev != NULL ? prev[i] : 0;
+			unsigned char c = prev != NULL && i >= bpp ? prev[i - bpp] : 0;
+			switch (f) {
+			case FILTER_NONE:
+				dst[i] = row[i];
+				break;
+			case FILTER_SUB:
+				dst[i] = row[i] - a;
+				break;
+			case FILTER_UP:
+				dst[i] = row[i] - b;
+				break;
+			case FILTER_AVERAGE:
+				dst[i] = row[i] - ((a + b) >> 1);
+				break;
+			case FILTER_PAETH:
+				dst[i] = row[i] - paeth(a, b, c);
+				break;
+			}
+			sum += dst[i] < 128 ? dst[i] : 256 - dst[i];
+		}
+
+		if (sum < best_sum) {
+			best_sum = sum;
+			best = f;
+		}
+
+	}
+
+	out[0] = best;
+	memcpy(&out[1], &candidates[best * length], length);
+}
+
+/* Filter and compress block of rows as a raw deflate stream terminated
+ * with the sync flush (or with the final block for the last one). */
+static void *encode_block(void *arg) {
+
+	struct pngenc_block *block = (struct pngenc_block *)arg;
+	const size_t length = (size_t)block->width * 3;
+	unsigned char *prev = NULL, *row = NULL, *candidates = NULL;
+	unsigned char *filtered = NULL, *dict = NULL;
+	bool initialized = false;
+	z_stream zs = { 0 };
+	int y;
+
+	if ((prev = malloc(length)) == NULL ||
+			(row = malloc(length)) == NULL ||
+			(candidates = malloc(length * 5)) == NULL ||
+			(filtered = malloc(1 + length)) == NULL ||
+			(dict = malloc(PNGENC_DICT_LENGTH)) == NULL)
+		goto final;
+
+	if (deflateInit2(&zs, PNGENC_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		goto final;
+	initialized = true;
+
+	/* Filter rows preceding this block in order to use them as the deflate
+	 * dictionary. This way blocks are independent and compression ratio is
+	 * nearly the same as with the single deflate stream. */
+	int dict_rows = (PNGENC_DICT_LENGTH + length) / (1 + length);
+	int y_dict = block->y0 - dict_rows > 0 ? block->y0 - dict_rows : 0;
+	size_t dict_length = 0;
+
+	if (y_dict > 0)
+		convert_row(&block->data[(size_t)(y_dict - 1) * block->stride], block->width, prev);
+	for (y = y_dict; y < block->y0; y++) {
+		convert_row(&block->data[(size_t)y * block->stride], block->width, row);
+		filter_row(y > 0 ? prev : NULL, row, length, candidates, filtered);
+		/* keep only the last 32 KiB of filtered data */
+		size_t n = 1 + length;
+		const unsigned char *src = filtered;
+		if (n > PNGENC_DICT_LENGTH) {
+			src += n - PNGENC_DICT_LENGTH;
+			n = PNGENC_DICT_LENGTH;
+		}
+		if (dict_length + n > PNGENC_DICT_LENGTH) {
+			size_t drop = dict_length + n - PNGENC_DICT_LENGTH;
+			memmove(dict, &dict[drop], dict_length - drop);
+			dict_length -= drop;
+		}
+		memcpy(&dict[dict_length], src, n);
+		dict_length += n;
+		memcpy(prev, row, length);
+	}
+
+	if (dict_length > 0 &&
+			deflateSetDictionary(&zs, dict, dict_length) != Z_OK)
+		goto final;
+
+	block->in_length = (1 + length) * (block->y1 - block->y0);
+	block->out_length = deflateBound(&zs, block->in_length) + 64;
+	if ((block->out = malloc(block->out_length)) == NULL)
+		goto final;
+
+	block->adler = adler32(0, NULL, 0);
+	zs.next_out = block->out;
+	zs.avail_out = block->out_length;
+
+	for (y = block->y0; y < block->y1; y++) {
+
+		int flush = Z_NO_FLUSH;
+		if (y + 1 == block->y1)
+			flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+		convert_row(&block->data[(size_t)y * block->stride], block->width, row);
+		filter_row(y > 0 ? prev : NULL, row, length, candidates, filtered);
+		block->adler = adler32(block->adler, filtered, 1 + length);
+
+		zs.next_in = filtered;
+		zs.avail_in = 1 + length;
+		int rv = deflate(&zs, flush);
+		if (rv == Z_STREAM_ERROR || zs.avail_in != 0 ||
+				(flush == Z_FINISH && rv != Z_STREAM_END))
+			goto final;
+
+		unsigned char *tmp = prev;
+		prev = row;
+		row = tmp;
+	}
+
+	block->out_length -= zs.avail_out;
+	block->crc = crc32(0, block->out, block->out_length);
+	block->ok = true;
+
+final:
+	if (initialized)
+		deflateEnd(&zs);
+	free(prev);
+	free(row);
+	free(candidates);
+	free(filtered);
+	free(dict);
+	return NULL;
+}
+
+/* Get the number of row blocks which shall be compressed in parallel. */
+static int get_blocks_count(int width, int height, int jobs) {
+
+	long blocks = (long)(1 + width * 3) * height / PNGENC_BLOCK_MIN_LENGTH;
+
+	if (blocks > jobs)
+		blocks = jobs;
+	if (blocks > PNGENC_BLOCKS_MAX)
+		blocks = PNGENC_BLOCKS_MAX;
+	if (blocks > height)
+		blocks = height;
+
+	return blocks < 1 ? 1 : blocks;
+}
+
+int pngenc_encode_rgb24(const unsigned char *data, int width, int height,
+		int stride, int jobs, unsigned char **png, size_t *length) {
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	struct pngenc_block blocks[PNGENC_BLOCKS_MAX] = { 0 };
+	pthread_t threads[PNGENC_BLOCKS_MAX];
+	bool threaded[PNGENC_BLOCKS_MAX] = { 0 };
+	unsigned long adler, crc;
+	unsigned char header[2];
+	size_t idat_length;
+	unsigned char *p;
+	int i, count;
+	int rv = -1;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	count = get_blocks_count(width, height, jobs);
+	for (i = 0; i < count; i++) {
+		blocks[i].data = data;
+		blocks[i].width = width;
+		blocks[i].stride = stride;
+		blocks[i].y0 = (long)height * i / count;
+		blocks[i].y1 = (long)height * (i + 1) / count;
+		blocks[i].last = i + 1 == count;
+	}
+
+	for (i = 1; i < count; i++)
+		threaded[i] = pthread_create(&threads[i], NULL, encode_block, &blocks[i]) == 0;
+	for (i = 0; i < count; i++)
+		if (!threaded[i])
+			encode_block(&blocks[i]);
+	/* all threads have to be joined before any block is released */
+	for (i = 0; i < count; i++)
+		if (threaded[i])
+			pthread_join(threads[i], NULL);
+
+	/* zlib stream header: deflate with 32K window, no preset dictionary */
+	header[0] = 0x78;
+	header[1] = 2 << 6;
+	header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+
+	idat_length = sizeof(header) + 4 /* Adler-32 */;
+	adler = adler32(0, NULL, 0);
+	crc = crc32(crc32(0, (const unsigned char *)"IDAT", 4), header, sizeof(header));
+
+	for (i = 0; i < count; i++) {
+		if (!blocks[i].ok)
+			goto final;
+		idat_length += blocks[i].out_length;
+		adler = adler32_combine(adler, blocks[i].adler, blocks[i].in_length);
+		crc = crc32_combine(crc, blocks[i].crc, blocks[i].out_length);
+	}
+
+	if (idat_length > 0x7FFFFFFF)
+		goto final;
+
+	*length = sizeof(signature) + (12 + 13) /* IHDR */ +
+		(12 + idat_length) /* IDAT */ + 12 /* IEND */;
+	if ((*png = p = malloc(*length)) == NULL)
+		goto final;
+
+	memcpy(p, signature, sizeof(signature));
+	p += sizeof(signature);
+
+	put_uint32(p, 13);
+	memcpy(&p[4], "IHDR", 4);
+	put_uint32(&p[8], width);
+	put_uint32(&p[12], height);
+	p[16] = 8; /* bit depth */
+	p[17] = 2; /* color type: RGB */
+	p[18] = 0; /* compression method */
+	p[19] = 0; /* filter method */
+	p[20] = 0; /* interlace method */
+	put_uint32(&p[21], crc32(0, &p[4], 4 + 13));
+	p += 12 + 13;
+
+	put_uint32(p, idat_length);
+	memcpy(&p[4], "IDAT", 4);
+	memcpy(&p[8], header, sizeof(header));
+	p += 8 + sizeof(header);
+	for (i = 0; i < count; i++) {
+		memcpy(p, blocks[i].out, blocks[i].out_length);
+		p += blocks[i].out_length;
+	}
+	put_uint32(p, adler);
+	crc = crc32(crc, p, 4);
+	put_uint32(&p[4], crc);
+	p += 8;
+
+	put_uint32(p, 0);
+	memcpy(&p[4], "IEND", 4);
+	put_uint32(&p[8], crc32(0, &p[4], 4));
+
+	rv = 0;
+
+final:
+	for (i = 0; i < count; i++)
+		free(blocks[i].out);
+	return rv;
+}
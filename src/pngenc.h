@@ -0,0 +1,24 @@
+/*
+ * EU-tire-label - pngenc.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_PNGENC_H_
+#define EUTIRELABEL_PNGENC_H_
+
+#include <stddef.h>
+
+/* Encode image in the Cairo RGB24 format as PNG. Row blocks are filtered
+ * and compressed by up to the given number of threads (jobs). Memory for the
+ * encoded data is obtained with malloc(3), and can be freed with free(3).
+ * Upon failure this function returns -1. */
+int pngenc_encode_rgb24(const unsigned char *data, int width, int height,
+		int stride, int jobs, unsigned char **png, size_t *length);
+
+#endif
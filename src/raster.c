@@ -9,13 +9,52 @@
  */
 
 #include "raster.h"
+#include "pngenc.h"
+#include "zpl.h"
+#if ENABLE_TEXT_OUTLINES
+# include "outline.h"
+#endif
 
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <librsvg/rsvg.h>
+#if ENABLE_WEBP
+# include <webp/encode.h>
+#endif
+
+/* Minimal number of pixels per band for parallel rendering. Below this
+ * threshold the cost of parsing SVG in every thread is not worth it. */
+#define RASTER_BAND_MIN_PIXELS (1024 * 1024)
+/* maximal number of bands rendered in parallel */
+#define RASTER_BANDS_MAX 16
+
+/* Minimal number of pixels for which the multi-threaded PNG encoder is
+ * used instead of the Cairo PNG writer. */
+#ifndef RASTER_PNGENC_MIN_PIXELS
+# define RASTER_PNGENC_MIN_PIXELS (1024 * 1024)
+#endif
+
+/* Maximal difference between colour components for which the pixel is
+ * considered grey, and as such is thresholded instead of dithered. */
+#define RASTER_ZPL_GREY_SPREAD 48
+/* number of memoized ZPL background bitmaps */
+#define RASTER_ZPL_BACKGROUNDS 4
+
+struct raster_band {
+	const char *svg;
+	size_t svg_length;
+	cairo_surface_t *surface;
+	double sx, sy;
+	int y;
+	bool ok;
+};
 
 /* Write PNG data into our raster structure. Note, that passed structure
  * should be initialized to 0, otherwise new data will be appended to end
@@ -23,7 +62,7 @@
 static cairo_status_t _png_write_callback(void *closure,
 		const unsigned char *data, unsigned int length) {
 
-	struct raster_png *png = (struct raster_png *)closure;
+	struct raster_image *png = (struct raster_image *)closure;
 	size_t new_length = png->length + length;
 	unsigned char *new_data;
 
@@ -38,59 +77,480 @@ static cairo_status_t _png_write_callback(void *closure,
 	return CAIRO_STATUS_SUCCESS;
 }
 
-/* Rasterise given SVG image into the PNG format. When dimensions (width and
- * height) are set to -1, than SVG view-box is used. If only height is set to
- * -1, then original aspect ratio is preserved and image is resized according
- * to the width parameter. Upon failure this function returns NULL. */
-struct raster_png *raster_svg_to_png(const char *svg,
-		int width, int height) {
+#if ENABLE_WEBP
+/* Append WebP data to our raster structure. */
+static int _webp_write_callback(const uint8_t *data, size_t length,
+		const WebPPicture *picture) {
+
+	struct raster_image *webp = (struct raster_image *)picture->custom_ptr;
+	size_t new_length = webp->length + length;
+	unsigned char *new_data;
+
+	if ((new_data = realloc(webp->data, new_length)) == NULL)
+		return 0;
+
+	memcpy(&new_data[webp->length], data, length);
+
+	webp->data = new_data;
+	webp->length = new_length;
+
+	return 1;
+}
+#endif
+
+/* Draw SVG image into the surface which covers horizontal band of the
+ * output image starting at the given row. */
+static bool _render_band(RsvgHandle *rsvg, cairo_surface_t *surface,
+		double sx, double sy, int y) {
+
+	cairo_t *cr = cairo_create(surface);
+	bool rv;
+
+	cairo_translate(cr, 0, -y);
+	cairo_scale(cr, sx, sy);
+	rv = rsvg_handle_render_cairo(rsvg, cr);
+
+	cairo_destroy(cr);
+	return rv;
+}
+
+static void *_render_band_thread(void *arg) {
+
+	struct raster_band *band = (struct raster_band *)arg;
+	RsvgHandle *rsvg;
+
+	/* RSVG handle can not be shared between threads */
+	if ((rsvg = rsvg_handle_new_from_data((const unsigned char *)band->svg,
+					band->svg_length, NULL)) == NULL)
+		return NULL;
+
+	band->ok = _render_band(rsvg, band->surface, band->sx, band->sy, band->y);
+
+	g_object_unref(G_OBJECT(rsvg));
+	return NULL;
+}
+
+/* Maximal number of threads used by a single rendering called from the
+ * current thread, or 0 for the number of CPUs. */
+static __thread int _threads = 0;
+
+/* Limit the number of threads used by rendering functions called from the
+ * current thread, e.g. when many labels are rendered in parallel anyway. */
+void raster_set_threads(int threads) {
+	_threads = threads;
+}
+
+static int _get_threads(void) {
+	long cpus;
+	if (_threads > 0)
+		return _threads;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus < 1 ? 1 : cpus;
+}
+
+/* Get the number of horizontal bands which shall be rendered in parallel
+ * for the image with given dimensions. */
+static int _get_bands_count(int width, int height) {
 
+	long bands = (long)width * height / RASTER_BAND_MIN_PIXELS;
+	long threads = _get_threads();
+
+	if (bands > threads)
+		bands = threads;
+	if (bands > RASTER_BANDS_MAX)
+		bands = RASTER_BANDS_MAX;
+	if (bands > height)
+		bands = height;
+
+	return bands < 1 ? 1 : bands;
+}
+
+/* Rasterise given SVG image into the Cairo RGB24 image surface. When
+ * dimensions (width and height) are set to -1, than SVG view-box is used.
+ * If only height is set to -1, then original aspect ratio is preserved and
+ * image is resized according to the width parameter. Upon failure this
+ * function returns NULL. */
+static cairo_surface_t *_render_svg(const char *svg, int width, int height) {
+
+	struct raster_band bands[RASTER_BANDS_MAX] = { 0 };
+	pthread_t threads[RASTER_BANDS_MAX];
+	bool threaded[RASTER_BANDS_MAX] = { 0 };
+	cairo_surface_t *surface = NULL;
 	RsvgHandle *rsvg;
 	RsvgDimensionData dimension;
-	cairo_t *cr;
-	cairo_surface_t *surface;
-	cairo_matrix_t matrix;
-	struct raster_png *png;
+	unsigned char *data;
+	size_t length;
+	int i, count, stride;
+	bool ok = true;
 
-	if ((png = calloc(1, sizeof(*png))) == NULL)
+#if ENABLE_TEXT_OUTLINES
+	/* Convert remaining (dynamic) text into outlines, so librsvg will not
+	 * have to initialize Pango and Fontconfig at all. */
+	char *outlined;
+	if ((outlined = outline_svg_text(svg, false)) == NULL)
 		return NULL;
+	svg = outlined;
+#endif
 
+	length = strlen(svg);
 	if ((rsvg = rsvg_handle_new_from_data((const unsigned char *)svg,
-					strlen(svg), NULL)) == NULL) {
-		raster_png_free(png);
-		return NULL;
-	}
+					length, NULL)) == NULL)
+		goto final;
 
 	/* initialize default dimensions based on the SVG view-box */
 	rsvg_handle_get_dimensions(rsvg, &dimension);
 	if (width == -1)
 		width = dimension.width;
 	if (height == -1)
-		height = round((double)(width * dimension.height) / dimension.width);
-
-	/* scale SVG image according to the given dimensions */
-	cairo_matrix_init_scale(&matrix,
-			(double)width / dimension.width, (double)height / dimension.height);
+		height = round((double)width * dimension.height / dimension.width);
 
 	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
-	cr = cairo_create(surface);
-	cairo_set_matrix(cr, &matrix);
+	/* e.g. out of memory or dimensions beyond the Cairo limits */
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		surface = NULL;
+		g_object_unref(G_OBJECT(rsvg));
+		goto final;
+	}
+	cairo_surface_flush(surface);
+	data = cairo_image_surface_get_data(surface);
+	stride = cairo_image_surface_get_stride(surface);
 
-	/* draw our SVG data to the Cairo surface */
-	if (rsvg_handle_render_cairo(rsvg, cr))
-		cairo_surface_write_to_png_stream(surface, _png_write_callback, png);
+	/* Split large images into horizontal bands, each one rendered by its
+	 * own thread directly into the final image surface. */
+	count = _get_bands_count(width, height);
+	for (i = 0; i < count; i++) {
+		int y = (long)height * i / count;
+		int h = (long)height * (i + 1) / count - y;
+		bands[i].svg = svg;
+		bands[i].svg_length = length;
+		bands[i].surface = cairo_image_surface_create_for_data(&data[y * stride],
+				CAIRO_FORMAT_RGB24, width, h, stride);
+		/* scale SVG image according to the given dimensions */
+		bands[i].sx = (double)width / dimension.width;
+		bands[i].sy = (double)height / dimension.height;
+		bands[i].y = y;
+	}
 
-	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
+	for (i = 1; i < count; i++)
+		threaded[i] = pthread_create(&threads[i], NULL, _render_band_thread, &bands[i]) == 0;
+
+	/* draw our SVG data to the Cairo surface - bands for which
+	 * thread could not be created are rendered in the main thread */
+	for (i = 0; i < count; i++)
+		if (!threaded[i])
+			bands[i].ok = _render_band(rsvg, bands[i].surface,
+					bands[i].sx, bands[i].sy, bands[i].y);
+
+	for (i = 0; i < count; i++) {
+		if (threaded[i])
+			pthread_join(threads[i], NULL);
+		if (!bands[i].ok)
+			ok = false;
+		cairo_surface_destroy(bands[i].surface);
+	}
+
+	cairo_surface_mark_dirty(surface);
 	g_object_unref(G_OBJECT(rsvg));
 
+	if (!ok) {
+		cairo_surface_destroy(surface);
+		surface = NULL;
+	}
+
+final:
+#if ENABLE_TEXT_OUTLINES
+	free(outlined);
+#endif
+	return surface;
+}
+
+/* Rasterise given SVG image into the PNG format. See _render_svg() for the
+ * meaning of the dimension parameters. Upon failure this function returns
+ * NULL. */
+struct raster_image *raster_svg_to_png(const char *svg,
+		int width, int height) {
+
+	struct raster_image *png;
+	cairo_surface_t *surface;
+
+	if ((png = calloc(1, sizeof(*png))) == NULL)
+		return NULL;
+
+	if ((surface = _render_svg(svg, width, height)) == NULL) {
+		raster_image_free(png);
+		return NULL;
+	}
+
+	width = cairo_image_surface_get_width(surface);
+	height = cairo_image_surface_get_height(surface);
+
+	/* fall back to the Cairo PNG writer in case of encoder failure */
+	if ((long)width * height < RASTER_PNGENC_MIN_PIXELS ||
+			pngenc_encode_rgb24(cairo_image_surface_get_data(surface), width, height,
+				cairo_image_surface_get_stride(surface), _get_threads(),
+				&png->data, &png->length) == -1)
+		if (cairo_surface_write_to_png_stream(surface, _png_write_callback, png) != CAIRO_STATUS_SUCCESS) {
+			raster_image_free(png);
+			png = NULL;
+		}
+
+	cairo_surface_destroy(surface);
 	return png;
 }
 
-/* Free memory allocated by the raster_svg_to_png function. */
-void raster_png_free(struct raster_png *png) {
-	if (png) {
-		free(png->data);
-		free(png);
+#if ENABLE_WEBP
+/* Rasterise given SVG image into the lossless WebP format. The effort
+ * parameter selects the trade-off between the encoding speed and the size
+ * of the output, from 0 (fastest) to 9 (smallest). */
+struct raster_image *raster_svg_to_webp(const char *svg,
+		int width, int height, int effort) {
+
+	struct raster_image *webp;
+	cairo_surface_t *surface;
+	WebPConfig config;
+	WebPPicture picture;
+	const unsigned char *data;
+	int x, y, stride;
+	bool ok = false;
+
+	if ((webp = calloc(1, sizeof(*webp))) == NULL)
+		return NULL;
+
+	if ((surface = _render_svg(svg, width, height)) == NULL) {
+		raster_image_free(webp);
+		return NULL;
+	}
+
+	if (!WebPConfigInit(&config) ||
+			!WebPConfigLosslessPreset(&config, effort < 0 ? 0 : effort > 9 ? 9 : effort) ||
+			!WebPPictureInit(&picture))
+		goto final;
+
+	picture.use_argb = 1;
+	picture.width = cairo_image_surface_get_width(surface);
+	picture.height = cairo_image_surface_get_height(surface);
+	if (!WebPPictureAlloc(&picture))
+		goto final;
+
+	/* Cairo RGB24 pixels are native-endian 0x00RRGGBB words, so the only
+	 * difference from the WebP ARGB format is the unused alpha channel. */
+	data = cairo_image_surface_get_data(surface);
+	stride = cairo_image_surface_get_stride(surface);
+	for (y = 0; y < picture.height; y++) {
+		const uint32_t *src = (const uint32_t *)&data[(size_t)y * stride];
+		uint32_t *dst = &picture.argb[(size_t)y * picture.argb_stride];
+		for (x = 0; x < picture.width; x++)
+			dst[x] = src[x] | 0xFF000000;
+	}
+
+	picture.writer = _webp_write_callback;
+	picture.custom_ptr = webp;
+	ok = WebPEncode(&config, &picture);
+
+	WebPPictureFree(&picture);
+
+final:
+	cairo_surface_destroy(surface);
+	if (!ok) {
+		raster_image_free(webp);
+		webp = NULL;
+	}
+	return webp;
+}
+#endif
+
+/* Ordered dithering threshold map. */
+static const unsigned char _bayer8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 }};
+
+/* Convert Cairo RGB24 surface into the monochrome bitmap. Grey pixels (text,
+ * lines and their anti-aliased edges) are thresholded, so they stay sharp,
+ * while colour scales are rendered with the ordered dithering. Ordered
+ * dithering produces patterns which repeat every byte, so flat areas are
+ * compressed as well as solid ones. */
+static int _surface_to_bitmap(cairo_surface_t *surface, struct zpl_bitmap *bitmap) {
+
+	const unsigned char *data = cairo_image_surface_get_data(surface);
+	const int stride = cairo_image_surface_get_stride(surface);
+	int x, y;
+
+	bitmap->width = cairo_image_surface_get_width(surface);
+	bitmap->height = cairo_image_surface_get_height(surface);
+	bitmap->stride = (bitmap->width + 7) / 8;
+	if ((bitmap->data = calloc(bitmap->height, bitmap->stride)) == NULL)
+		return -1;
+
+	for (y = 0; y < bitmap->height; y++) {
+		const uint32_t *src = (const uint32_t *)&data[(size_t)y * stride];
+		unsigned char *dst = &bitmap->data[(size_t)y * bitmap->stride];
+		for (x = 0; x < bitmap->width; x++) {
+
+			const int r = (src[x] >> 16) & 0xFF;
+			const int g = (src[x] >> 8) & 0xFF;
+			const int b = src[x] & 0xFF;
+			const int luma = (r * 77 + g * 150 + b * 29) >> 8;
+			const int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+			const int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+
+			const int threshold = max - min <= RASTER_ZPL_GREY_SPREAD ?
+				128 : _bayer8[y % 8][x % 8] * 4 + 2;
+			if (luma < threshold)
+				dst[x / 8] |= 0x80 >> (x % 8);
+
+		}
+	}
+
+	return 0;
+}
+
+/* Rasterise given SVG image into the monochrome bitmap. */
+static int _render_bitmap(const char *svg, int width, int height, struct zpl_bitmap *bitmap) {
+
+	cairo_surface_t *surface;
+	int rv;
+
+	if ((surface = _render_svg(svg, width, height)) == NULL)
+		return -1;
+
+	rv = _surface_to_bitmap(surface, bitmap);
+	cairo_surface_destroy(surface);
+	return rv;
+}
+
+static struct {
+	pthread_mutex_t mutex;
+	unsigned int next;
+	struct {
+		char *svg;
+		int width;
+		int height;
+		struct zpl_bitmap bitmap;
+	} entries[RASTER_ZPL_BACKGROUNDS];
+} _backgrounds = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* Rasterise given background SVG image into the monochrome bitmap. All
+ * labels of a batch share a few backgrounds, so recently used bitmaps are
+ * memoized and every background is rendered only once. */
+static int _render_background(const char *svg, int width, int height,
+		struct zpl_bitmap *bitmap) {
+
+	size_t length;
+	unsigned int i;
+
+	pthread_mutex_lock(&_backgrounds.mutex);
+	for (i = 0; i < RASTER_ZPL_BACKGROUNDS; i++)
+		if (_backgrounds.entries[i].svg != NULL &&
+				_backgrounds.entries[i].width == width &&
+				_backgrounds.entries[i].height == height &&
+				strcmp(_backgrounds.entries[i].svg, svg) == 0) {
+			*bitmap = _backgrounds.entries[i].bitmap;
+			length = (size_t)bitmap->stride * bitmap->height;
+			if ((bitmap->data = malloc(length)) != NULL)
+				memcpy(bitmap->data, _backgrounds.entries[i].bitmap.data, length);
+			pthread_mutex_unlock(&_backgrounds.mutex);
+			return bitmap->data != NULL ? 0 : -1;
+		}
+	pthread_mutex_unlock(&_backgrounds.mutex);
+
+	if (_render_bitmap(svg, width, height, bitmap) == -1)
+		return -1;
+
+	char *svg_copy = strdup(svg);
+	length = (size_t)bitmap->stride * bitmap->height;
+	unsigned char *data = malloc(length);
+	if (svg_copy == NULL || data == NULL) {
+		/* memoization is optional */
+		free(svg_copy);
+		free(data);
+		return 0;
+	}
+
+	memcpy(data, bitmap->data, length);
+
+	pthread_mutex_lock(&_backgrounds.mutex);
+	i = _backgrounds.next++ % RASTER_ZPL_BACKGROUNDS;
+	free(_backgrounds.entries[i].svg);
+	free(_backgrounds.entries[i].bitmap.data);
+	_backgrounds.entries[i].svg = svg_copy;
+	_backgrounds.entries[i].width = width;
+	_backgrounds.entries[i].height = height;
+	_backgrounds.entries[i].bitmap = *bitmap;
+	_backgrounds.entries[i].bitmap.data = data;
+	pthread_mutex_unlock(&_backgrounds.mutex);
+
+	return 0;
+}
+
+/* Release memoized backgrounds when the module is unloaded. */
+__attribute__((destructor))
+static void _release_backgrounds(void) {
+	unsigned int i;
+	for (i = 0; i < RASTER_ZPL_BACKGROUNDS; i++) {
+		free(_backgrounds.entries[i].svg);
+		free(_backgrounds.entries[i].bitmap.data);
+	}
+}
+
+/* Rasterise given SVG image into the monochrome ZPL label for thermal
+ * printers. If the background SVG image is given, it is expected to be
+ * stored in the printer memory (see raster_svg_to_zpl_graphic()), and only
+ * the difference between the label and the background is encoded. */
+struct raster_image *raster_svg_to_zpl(const char *svg, const char *background,
+		int width, int height) {
+
+	struct zpl_bitmap image = { 0 };
+	struct zpl_bitmap bg = { 0 };
+	struct raster_image *zpl;
+
+	if ((zpl = calloc(1, sizeof(*zpl))) == NULL)
+		return NULL;
+
+	if (_render_bitmap(svg, width, height, &image) == -1 ||
+			(background != NULL &&
+			 _render_background(background, width, height, &bg) == -1) ||
+			zpl_encode_label(&image, background != NULL ? &bg : NULL,
+				&zpl->data, &zpl->length) == -1) {
+		raster_image_free(zpl);
+		zpl = NULL;
+	}
+
+	free(image.data);
+	free(bg.data);
+	return zpl;
+}
+
+/* Rasterise given SVG image into the ZPL command which stores the image in
+ * the printer memory, so it can be used as a label background. */
+struct raster_image *raster_svg_to_zpl_graphic(const char *svg, int width, int height) {
+
+	struct zpl_bitmap image = { 0 };
+	struct raster_image *zpl;
+
+	if ((zpl = calloc(1, sizeof(*zpl))) == NULL)
+		return NULL;
+
+	if (_render_background(svg, width, height, &image) == -1 ||
+			zpl_encode_graphic(&image, &zpl->data, &zpl->length) == -1) {
+		raster_image_free(zpl);
+		zpl = NULL;
+	}
+
+	free(image.data);
+	return zpl;
+}
+
+/* Free memory allocated by the raster_svg_to_* functions. */
+void raster_image_free(struct raster_image *image) {
+	if (image) {
+		free(image->data);
+		free(image);
 	}
 }
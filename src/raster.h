@@ -14,12 +14,20 @@
 
 #include <stddef.h>
 
-struct raster_png {
+struct raster_image {
 	unsigned char *data;
 	size_t length;
 };
 
-struct raster_png *raster_svg_to_png(const char *svg, int width, int height);
-void raster_png_free(struct raster_png *png);
+struct raster_image *raster_svg_to_png(const char *svg, int width, int height);
+struct raster_image *raster_svg_to_webp(const char *svg, int width, int height, int effort);
+struct raster_image *raster_svg_to_zpl(const char *svg, const char *background,
+		int width, int height);
+struct raster_image *raster_svg_to_zpl_graphic(const char *svg, int width, int height);
+void raster_image_free(struct raster_image *image);
+
+/* Limit the number of threads used by rendering functions called from the
+ * current thread. Zero stands for the number of CPUs (default). */
+void raster_set_threads(int threads);
 
 #endif
@@ -0,0 +1,66 @@
+/*
+ * EU-tire-label - svgoutline.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "outline.h"
+
+/* Convert static text of the SVG template into path outlines. Text elements
+ * with template placeholders are left intact. */
+int svgoutline(const char *filename) {
+
+	FILE *in;
+	char *svg = NULL, *outlined;
+	size_t length = 0, size = 0, n;
+
+	if ((in = fopen(filename, "r")) == NULL)
+		return -1;
+
+	do {
+		char *tmp;
+		size += 4096;
+		if ((tmp = realloc(svg, size)) == NULL)
+			goto fail;
+		svg = tmp;
+		length += n = fread(&svg[length], 1, size - length - 1, in);
+	} while (n > 0);
+	svg[length] = '\0';
+
+	if ((outlined = outline_svg_text(svg, true)) == NULL)
+		goto fail;
+
+	printf("%s", outlined);
+
+	free(outlined);
+	free(svg);
+	fclose(in);
+	return 0;
+
+fail:
+	free(svg);
+	fclose(in);
+	return -1;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <file>\n", argv[0]);
+		return 1;
+	}
+
+	if (svgoutline(argv[1]) == -1) {
+		perror("svgoutline");
+		return 1;
+	}
+
+	return 0;
+}
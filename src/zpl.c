@@ -0,0 +1,361 @@
+/*
+ * EU-tire-label - zpl.c
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "zpl.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "base64.h"
+
+/* Number of unchanged rows which might be included in the overlay field.
+ * Every new field costs roughly 40 bytes of headers, while the unchanged
+ * row costs a single byte with the ASCII compression. */
+#define ZPL_OVERLAY_GAP_ROWS 32
+
+struct zpl_buffer {
+	char *data;
+	size_t length;
+	size_t size;
+	bool error;
+};
+
+static char *zpl_buffer_reserve(struct zpl_buffer *buffer, size_t length) {
+
+	if (buffer->error)
+		return NULL;
+
+	if (buffer->length + length > buffer->size) {
+		size_t size = buffer->size * 2;
+		if (size < buffer->length + length)
+			size = buffer->length + length + 4096;
+		char *data;
+		if ((data = realloc(buffer->data, size)) == NULL) {
+			buffer->error = true;
+			return NULL;
+		}
+		buffer->data = data;
+		buffer->size = size;
+	}
+
+	return &buffer->data[buffer->length];
+}
+
+static void zpl_buffer_append(struct zpl_buffer *buffer, const void *data, size_t length) {
+	char *p;
+	if ((p = zpl_buffer_reserve(buffer, length)) != NULL) {
+		memcpy(p, data, length);
+		buffer->length += length;
+	}
+}
+
+static void zpl_buffer_printf(struct zpl_buffer *buffer, const char *format, ...) {
+
+	char tmp[128];
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(tmp, sizeof(tmp), format, ap);
+	va_end(ap);
+
+	zpl_buffer_append(buffer, tmp, n);
+}
+
+/* Write the run of the same hexadecimal digit using the ZPL compression
+ * scheme: G-Y stand for 1-19 repetitions, g-y stand for 20-380 repetitions
+ * and z stands for 400 repetitions. Counts are summed up. */
+static char *zpl_acs_run(char *p, char digit, size_t count) {
+
+	if (count == 1) {
+		*p++ = digit;
+		return p;
+	}
+
+	for (; count >= 400; count -= 400)
+		*p++ = 'z';
+	if (count >= 20) {
+		*p++ = 'f' + count / 20;
+		count %= 20;
+	}
+	if (count > 0)
+		*p++ = 'F' + count;
+
+	*p++ = digit;
+	return p;
+}
+
+/* Write the bitmap region with the ZPL ASCII compression scheme. Row which
+ * is the same as the previous one is written as a colon, and trailing runs
+ * of zeros or ones are written as a comma or an exclamation mark. */
+static void zpl_encode_acs(struct zpl_buffer *buffer, const unsigned char *data,
+		int stride, int width, int height) {
+
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *prev = NULL;
+	int x, y;
+
+	for (y = 0; y < height; y++, data += stride) {
+
+		if (prev != NULL && memcmp(data, prev, width) == 0) {
+			zpl_buffer_append(buffer, ":", 1);
+			continue;
+		}
+		prev = data;
+
+		char *p, *start;
+		/* worst case: every nibble differs from its neighbour */
+		if ((start = p = zpl_buffer_reserve(buffer, width * 2 + 1)) == NULL)
+			return;
+
+		/* find trailing run of zero or one nibbles */
+		int end = width * 2;
+		const int tail = data[width - 1] & 0x0F;
+		char fill = '\0';
+		if (tail == 0x0 || tail == 0xF) {
+			while (end > 0 && (end % 2 ?
+						data[end / 2] >> 4 : data[end / 2 - 1] & 0x0F) == tail)
+				end--;
+			fill = tail == 0x0 ? ',' : '!';
+		}
+
+		for (x = 0; x < end;) {
+			const int nibble = x % 2 ? data[x / 2] & 0x0F : data[x / 2] >> 4;
+			int n = x + 1;
+			while (n < end && (n % 2 ? data[n / 2] & 0x0F : data[n / 2] >> 4) == nibble)
+				n++;
+			p = zpl_acs_run(p, hex[nibble], n - x);
+			x = n;
+		}
+
+		if (fill != '\0')
+			*p++ = fill;
+
+		buffer->length += p - start;
+	}
+
+}
+
+/* CRC-16/XMODEM checksum of the Z64 encoded data. */
+static uint16_t zpl_crc16(const char *data, size_t length) {
+
+	uint16_t crc = 0;
+	size_t i;
+	int j;
+
+	for (i = 0; i < length; i++) {
+		crc ^= (uint16_t)(unsigned char)data[i] << 8;
+		for (j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+/* Write the bitmap region as the zlib compressed and base64 encoded data
+ * (the Z64 scheme). Upon failure this function returns -1. */
+static int zpl_encode_z64(struct zpl_buffer *buffer, const unsigned char *data,
+		int stride, int width, int height) {
+
+	const size_t length = (size_t)width * height;
+	uLongf compressed_length = compressBound(length);
+	unsigned char *region, *compressed = NULL;
+	int rv = -1;
+	int y;
+
+	if ((region = malloc(length)) == NULL ||
+			(compressed = malloc(compressed_length)) == NULL)
+		goto final;
+
+	for (y = 0; y < height; y++)
+		memcpy(&region[(size_t)y * width], &data[(size_t)y * stride], width);
+	if (compress2(compressed, &compressed_length, region, length, Z_BEST_COMPRESSION) != Z_OK)
+		goto final;
+
+	char *p;
+	if ((p = zpl_buffer_reserve(buffer, BASE64_LENGTH(compressed_length) + 16)) == NULL)
+		goto final;
+
+	memcpy(p, ":Z64:", 5);
+	char *encoded = p + 5;
+	p = base64_encode(encoded, compressed, compressed_length);
+	p += sprintf(p, ":%04x", zpl_crc16(encoded, p - encoded));
+
+	buffer->length = p - buffer->data;
+	rv = 0;
+
+final:
+	free(compressed);
+	free(region);
+	return rv;
+}
+
+/* Write the ^GF graphic field data for the bitmap region. Both compression
+ * schemes are tried and the shorter one is used. */
+static void zpl_encode_field(struct zpl_buffer *buffer, const unsigned char *data,
+		int stride, int width, int height) {
+
+	struct zpl_buffer acs = { 0 };
+	struct zpl_buffer z64 = { 0 };
+	const size_t length = (size_t)width * height;
+
+	zpl_encode_acs(&acs, data, stride, width, height);
+	if (zpl_encode_z64(&z64, data, stride, width, height) == -1)
+		z64.error = true;
+
+	if (acs.error && z64.error)
+		buffer->error = true;
+	else {
+		const struct zpl_buffer *best = z64.error ||
+			(!acs.error && acs.length <= z64.length) ? &acs : &z64;
+		zpl_buffer_printf(buffer, "^GFA,%zu,%zu,%d,", length, length, width);
+		zpl_buffer_append(buffer, best->data, best->length);
+	}
+
+	free(acs.data);
+	free(z64.data);
+}
+
+/* Get the name of the stored graphic. The name is derived from the image
+ * content, so a changed background is never mixed up with the old one. */
+static void zpl_graphic_name(const struct zpl_bitmap *image, char *name, size_t size) {
+
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < (size_t)image->stride * image->height; i++)
+		hash = (hash ^ image->data[i]) * 16777619u;
+	hash ^= (uint32_t)image->width << 16 ^ image->height;
+
+	snprintf(name, size, "R:L%07X.GRF", (unsigned int)(hash & 0x0FFFFFFF));
+}
+
+/* Write the difference between the image and the background as fields
+ * printed in the reverse mode (XOR with the background). Unchanged rows
+ * are skipped, so only the variable parts of the label are sent. */
+static void zpl_encode_overlay(struct zpl_buffer *buffer,
+		const struct zpl_bitmap *image, const struct zpl_bitmap *background) {
+
+	const int stride = image->stride;
+	unsigned char *diff;
+	int x, y;
+
+	if ((diff = malloc((size_t)stride * image->height)) == NULL) {
+		buffer->error = true;
+		return;
+	}
+
+	for (y = 0; y < image->height; y++)
+		for (x = 0; x < stride; x++)
+			diff[(size_t)y * stride + x] = image->data[(size_t)y * stride + x] ^
+				background->data[(size_t)y * background->stride + x];
+
+	for (y = 0; y < image->height;) {
+
+		int y0, y1 = -1, gap = 0;
+		int x0 = stride, x1 = -1;
+
+		/* find the band of changed rows, possibly with small gaps */
+		for (y0 = y; y < image->height && gap <= ZPL_OVERLAY_GAP_ROWS; y++) {
+			const unsigned char *row = &diff[(size_t)y * stride];
+			int first = 0, last = stride - 1;
+			while (first < stride && row[first] == 0)
+				first++;
+			if (first == stride) {
+				if (y1 != -1)
+					gap++;
+				continue;
+			}
+			while (row[last] == 0)
+				last--;
+			if (y1 == -1)
+				y0 = y;
+			if (first < x0)
+				x0 = first;
+			if (last > x1)
+				x1 = last;
+			y1 = y;
+			gap = 0;
+		}
+
+		if (y1 == -1)
+			break;
+
+		zpl_buffer_printf(buffer, "^FO%d,%d^FR", x0 * 8, y0);
+		zpl_encode_field(buffer, &diff[(size_t)y0 * stride + x0], stride,
+				x1 - x0 + 1, y1 - y0 + 1);
+		zpl_buffer_append(buffer, "^FS\n", 4);
+
+		y = y1 + 1;
+	}
+
+	free(diff);
+}
+
+int zpl_encode_label(const struct zpl_bitmap *image, const struct zpl_bitmap *background,
+		unsigned char **zpl, size_t *length) {
+
+	struct zpl_buffer buffer = { 0 };
+
+	zpl_buffer_printf(&buffer, "^XA\n^PW%d^LL%d^LH0,0\n", image->width, image->height);
+
+	if (background != NULL &&
+			background->width == image->width &&
+			background->height == image->height) {
+		char name[32];
+		zpl_graphic_name(background, name, sizeof(name));
+		zpl_buffer_printf(&buffer, "^FO0,0^XG%s,1,1^FS\n", name);
+		zpl_encode_overlay(&buffer, image, background);
+	}
+	else {
+		zpl_buffer_append(&buffer, "^FO0,0", 6);
+		zpl_encode_field(&buffer, image->data, image->stride, image->stride, image->height);
+		zpl_buffer_append(&buffer, "^FS\n", 4);
+	}
+
+	zpl_buffer_append(&buffer, "^XZ\n", 4);
+
+	if (buffer.error) {
+		free(buffer.data);
+		return -1;
+	}
+
+	*zpl = (unsigned char *)buffer.data;
+	*length = buffer.length;
+	return 0;
+}
+
+int zpl_encode_graphic(const struct zpl_bitmap *image, unsigned char **zpl, size_t *length) {
+
+	struct zpl_buffer buffer = { 0 };
+	const size_t total = (size_t)image->stride * image->height;
+	char name[32];
+
+	/* the download graphics command accepts the ASCII compression only */
+	zpl_graphic_name(image, name, sizeof(name));
+	zpl_buffer_printf(&buffer, "~DG%s,%zu,%d,", name, total, image->stride);
+	zpl_encode_acs(&buffer, image->data, image->stride, image->stride, image->height);
+	zpl_buffer_append(&buffer, "\n", 1);
+
+	if (buffer.error) {
+		free(buffer.data);
+		return -1;
+	}
+
+	*zpl = (unsigned char *)buffer.data;
+	*length = buffer.length;
+	return 0;
+}
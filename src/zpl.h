@@ -0,0 +1,39 @@
+/*
+ * EU-tire-label - zpl.h
+ * Copyright (c) 2015-2021 Arkadiusz Bokowy
+ *
+ * This file is a part of EU-tire-label.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef EUTIRELABEL_ZPL_H_
+#define EUTIRELABEL_ZPL_H_
+
+#include <stddef.h>
+
+/* Monochrome image, where every row is packed into bytes with the most
+ * significant bit first, and the set bit is a printed (black) dot. */
+struct zpl_bitmap {
+	unsigned char *data;
+	int width;
+	int height;
+	/* number of bytes per row */
+	int stride;
+};
+
+/* Encode image as a complete ZPL label. If the background is given, it is
+ * recalled from the printer memory, so only the difference between the
+ * image and the background is sent. Memory for the encoded data is obtained
+ * with malloc(3), and can be freed with free(3). Upon failure this function
+ * returns -1. */
+int zpl_encode_label(const struct zpl_bitmap *image, const struct zpl_bitmap *background,
+		unsigned char **zpl, size_t *length);
+
+/* Encode image as the ZPL command which stores it in the printer memory,
+ * so it can be used as a background for subsequent labels. */
+int zpl_encode_graphic(const struct zpl_bitmap *image, unsigned char **zpl, size_t *length);
+
+#endif